@@ -1,10 +1,21 @@
 #ifndef LIGHT_CONTROL_H
 #define LIGHT_CONTROL_H
 
+#include <stdint.h>
+
+/* Set of light ids 0..255, bit (id & 31) of bits[id >> 5] */
+#define LIGHT_SET_WORDS 8
+typedef struct {
+    uint32_t bits[LIGHT_SET_WORDS];
+} LightSet;
+
 void LightControl_init(void);
 void LightControl_destroy(void);
 void LightControl_on(int id);
 void LightControl_off(int id);
+/* Batched updates: switch every light of the set in one driver call */
+void LightControl_onMany(const LightSet *lights);
+void LightControl_offMany(const LightSet *lights);
 
 
 #endif
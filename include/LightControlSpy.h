@@ -13,5 +13,6 @@ enum {
 int LightControlSpy_getLastLightId(void); 
 int LightControlSpy_getLastState(void); 
 int did_you_pass_by_me(void);
+int LightControlSpy_getBatchCount(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,78 @@
+#ifndef LIGHT_SCHEDULE_SHM_H
+#define LIGHT_SCHEDULE_SHM_H
+
+#include "LightScheduler.h"
+#include <stdint.h>
+
+/* Layout of the POSIX shared-memory segment published by
+   LightScheduler_share(). The scheduler edits events[] in place and keeps a
+   copy of its static table (LightScheduler_initStatic) with the mask of the
+   static events removed at runtime, and of its groups and calendars; readers in
+   other processes map the segment read-only and use the sequence counter as
+   a seqlock: it is odd while an edit is in progress and changes on every
+   edit, so a copy taken between two equal even values is consistent. */
+#define LIGHT_SCHEDULE_SHM_MAGIC 0x4c534348u    /* "LSCH" */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t eventSize;             /* sizeof(ScheduledEvent) of the writer */
+    uint32_t capacity;              /* LIGHT_SCHEDULER_MAX_EVENTS of the writer */
+    volatile uint32_t sequence;     /* Seqlock counter, odd while writing */
+    uint32_t version;               /* Incremented by every committed edit */
+    int32_t eventCount;             /* events[0..eventCount) are used, check .active */
+    ScheduledEvent events[LIGHT_SCHEDULER_MAX_EVENTS];
+    int32_t staticEventCount;       /* Events of the static table, 0 when there is none */
+    uint32_t staticRemoved[8];      /* Bit i is set once static event i has been removed */
+    ScheduledEvent staticEvents[256];
+    int32_t groupCount;             /* Group id g is groups[g - 1] */
+    LightSet groups[LIGHT_SCHEDULER_MAX_GROUPS];
+    int32_t calendarCount;          /* Calendar id c is calendars[c - 1] */
+    LightScheduleCalendar calendars[LIGHT_SCHEDULER_MAX_CALENDARS];
+} LightScheduleSegment;
+
+/* Writer side, used by the scheduler */
+LightScheduleSegment *LightScheduleShm_create(const char *name);
+void LightScheduleShm_destroy(LightScheduleSegment *segment, const char *name);
+
+/* Reader side, for monitoring processes */
+typedef struct {
+    const LightScheduleSegment *segment;
+} LightScheduleReader;
+
+/* Maps the segment called name (e.g. "/light_scheduler") read-only.
+   Returns 0, or -1 if it does not exist or was written by another layout. */
+int LightScheduleReader_open(LightScheduleReader *reader, const char *name);
+
+/* Version of the table, cheap enough to poll before taking a snapshot */
+uint32_t LightScheduleReader_version(const LightScheduleReader *reader);
+
+/* Snapshots retry while the scheduler is inside an edit, up to this many
+   times (a fraction of a second): a scheduler that crashed during an edit, or
+   before publishing the segment, makes them fail instead of hanging */
+#define LIGHT_SCHEDULE_READ_ATTEMPTS 100000
+
+/* Copies a consistent snapshot of events[0..eventCount) into out (at most max
+   slots) and its version into version (if not NULL). Returns the number of
+   slots copied, or -1 on invalid arguments or if no consistent copy could be
+   taken within LIGHT_SCHEDULE_READ_ATTEMPTS attempts. */
+int LightScheduleReader_snapshot(const LightScheduleReader *reader, ScheduledEvent *out,
+                                 int max, uint32_t *version);
+
+/* Same for the static table: copies its events (at most max) into out and,
+   if removed is not NULL, the mask of the removed ones into removed[0..8)
+   (bit i for handle LIGHT_SCHEDULER_STATIC_BASE + i). Returns the number of
+   events copied, 0 without a static table, or -1 as for the snapshot. */
+int LightScheduleReader_snapshotStatic(const LightScheduleReader *reader, ScheduledEvent *out,
+                                       int max, uint32_t *removed, uint32_t *version);
+
+/* Same for the groups and the calendars events refer to by id: copy the
+   first max of them into out and return how many were copied, or -1 as for
+   the snapshot. Compare the versions to match them with an events snapshot. */
+int LightScheduleReader_snapshotGroups(const LightScheduleReader *reader, LightSet *out,
+                                       int max, uint32_t *version);
+int LightScheduleReader_snapshotCalendars(const LightScheduleReader *reader,
+                                          LightScheduleCalendar *out, int max, uint32_t *version);
+
+void LightScheduleReader_close(LightScheduleReader *reader);
+
+#endif
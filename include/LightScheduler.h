@@ -1,19 +1,76 @@
 #ifndef LIGHT_SCHEDULER_H
 #define LIGHT_SCHEDULER_H
 #include "LightControlSpy.h"
+#include "LightControl.h"
 #include "TimeService.h"
 #include <stdbool.h>
+#include <stdint.h>
 void LightScheduler_init(void);
 void LightScheduler_destroy(void);
+/* Removes every event, group and calendar (and the static table) without
+   touching the driver or the alarm */
+void LightScheduler_clear(void);
 int LightScheduler_schedule(int lightId, WeekDay day, int minute, int action);
-void LightScheduler_remove(int id);
+
+/* Returns 0, or -1 if id is not the handle of a scheduled event (unknown,
+   stale or already removed) */
+int LightScheduler_remove(int id);
 bool matches_day(WeekDay scheduled, WeekDay current) ;
 void LightScheduler_wakeup(void) ;
+/* Same as LightScheduler_wakeup, for a given time instead of TimeService's */
+void LightScheduler_wakeupAt(Time now);
 int turn_on_led_now(int id);
 int turn_off_led_now(int id);
+/* Legacy flag of the event with handle id, false if id is not a live event */
 bool did_u_wake_me_up_one_minute_before(int id);
+
+/* Copies the ids of the active events of lightId into out (at most max of them:
+   its own events in scheduling order, then the events of each group it belongs
+   to). Returns the number of ids written, -1 on invalid input. O(ids written). */
+int LightScheduler_eventsForLight(int lightId, int *out, int max);
+
+/* Copies the ids of the active events firing on day between minutes from and to
+   (inclusive) into out, ordered by minute. day must be MONDAY..SUNDAY.
+   Returns the number of ids written, -1 on invalid input. */
+int LightScheduler_eventsInRange(WeekDay day, int from, int to, int *out, int max);
+
+/* State of the 256 lights, one bit per light id: known is set for the lights
+   that have at least one scheduled event, on is set for those that are ON. */
+typedef struct {
+    uint32_t known[8];
+    uint32_t on[8];
+} StateBitmap;
+
+static inline bool StateBitmap_isKnown(const StateBitmap *s, int id) {
+    return (s->known[id >> 5] >> (id & 31)) & 1u;
+}
+
+static inline bool StateBitmap_isOn(const StateBitmap *s, int id) {
+    return (s->on[id >> 5] >> (id & 31)) & 1u;
+}
+
+/* Fills out with the state the weekly schedule implies at time t, i.e. the
+   action of the last event of each light at or before t (wrapping around the
+   week). When t carries a date, events blocked by their calendar on the day
+   they would have fired are skipped. Returns 0, or -1 if t is not a valid
+   day/minute. */
+int LightScheduler_stateAt(Time t, StateBitmap *out);
+
+/* Drives every light to the state implied at the current time. Only the lights
+   whose state differs from actual (or is unknown in actual) are sent to the
+   driver; actual may be NULL to send them all. Returns the number of commands
+   sent, -1 if the current time is invalid. */
+int LightScheduler_reconcile(const StateBitmap *actual);
+
 typedef enum { TURN_OFF, TURN_ON } Action;
 
+/* How an event uses its exception calendar */
+typedef enum {
+    CALENDAR_NONE,      // Fires on every day matching its WeekDay pattern
+    CALENDAR_ONLY,      // ...but only on the dates of the calendar
+    CALENDAR_EXCEPT     // ...except on the dates of the calendar
+} CalendarMode;
+
 typedef struct {
     int id;
     int lightId;
@@ -22,5 +79,167 @@ typedef struct {
     Action action;
     bool active;
     bool one_minute_befores;
+    int nextForLight;   // next active event of the same light, -1 at the end
+    int prevForLight;   // previous active event of the same light, -1 at the head
+    int calendar;       // Exception calendar id, used unless calendarMode is CALENDAR_NONE
+    CalendarMode calendarMode;
+    int group;          // Light group id targeted instead of lightId, 0 for a single light
+    int generation;     // Bumped when the event is removed, part of the handle of the slot
+    uint32_t order;     // Scheduling order of runtime events (slots are reused), 0 in static tables
 } ScheduledEvent;
+
+/* One firing of a light in the week, used to answer LightScheduler_stateAt */
+typedef struct {
+    int16_t weekMinute;     // (day - MONDAY) * 24*60 + minute
+    uint8_t slot;           // Event id; ties inside a minute follow the event's order, then id
+    uint8_t action;         // TURN_ON or TURN_OFF
+} ScheduleTransition;
+
+/* Capacity of the runtime event table, i.e. of the mutable overlay when a
+   static table is used. Each slot costs about 130 bytes of RAM (event, day
+   rows, transitions): 256 slots take about 33 KB, while a fixed installation
+   running from a static table can build with -DLIGHT_SCHEDULER_MAX_EVENTS=16
+   for a 2 KB overlay. At most 256. */
+#ifndef LIGHT_SCHEDULER_MAX_EVENTS
+#define LIGHT_SCHEDULER_MAX_EVENTS 256
+#endif
+#if LIGHT_SCHEDULER_MAX_EVENTS < 1 || LIGHT_SCHEDULER_MAX_EVENTS > 256
+#error "LIGHT_SCHEDULER_MAX_EVENTS must be between 1 and 256"
+#endif
+
+/* Pre-sorted, pre-indexed schedule. The scheduler keeps its own events in one
+   of these, and tools/generate_schedule.rb emits const ones (see
+   `make schedule_tables`) that live in read-only memory. At most 256 events. */
+typedef struct {
+    const ScheduledEvent *events;               // events[i].id == i
+    int eventCount;
+    const int *lightHead;                       // 256 entries, first event of each light or -1
+    const int *dayIndex[7];                     // Event ids firing each day, by minute, order, then id
+    int dayCount[7];
+    const ScheduleTransition *transitions;      // Firings of each light, by week minute, order, then id
+    const int *transitionStart;                 // 257 entries, light l owns [start[l], start[l+1])
+} LightScheduleTable;
+
+/* One event of a schedule passed to LightScheduler_apply */
+typedef struct {
+    int lightId;
+    WeekDay day;
+    int minute;
+    Action action;
+    int calendar;
+    CalendarMode calendarMode;
+    int group;          // When not 0, the entry targets this group and lightId is ignored
+} ScheduleEntry;
+
+/* Replaces the live schedule by entries[0..count) without re-initializing the
+   scheduler or the driver. Events already live and equal to an entry are kept
+   with their handle; only the others are removed or added, all between two
+   ticks. If handles is not NULL, handles[i] receives the handle of entries[i].
+   Returns the number of events added plus removed, or -1 (and changes
+   nothing) if an entry is invalid or the result does not fit. */
+int LightScheduler_apply(const ScheduleEntry *entries, int count, int *handles);
+
+/* Exception calendars: named sets of dates (holidays, closures...) that events
+   can be restricted to or excluded from. Dates are turned into per-year day
+   bitmaps when added, so the wakeup path only tests one bit per event. An
+   event with a calendar never fires when the current date is unknown
+   (Time.year == 0) in CALENDAR_ONLY mode, and always does in CALENDAR_EXCEPT. */
+#define LIGHT_SCHEDULER_MAX_CALENDARS 8
+#define LIGHT_SCHEDULER_CALENDAR_YEARS 4
+
+/* A calendar as published in the shared segment: years[0..yearCount) with
+   one day bitmap each, bit (dayOfYear - 1) */
+typedef struct {
+    char name[16];
+    int32_t yearCount;
+    int32_t years[LIGHT_SCHEDULER_CALENDAR_YEARS];
+    uint32_t days[LIGHT_SCHEDULER_CALENDAR_YEARS][12];
+} LightScheduleCalendar;
+
+/* Returns the id (1..LIGHT_SCHEDULER_MAX_CALENDARS) of the calendar called
+   name, creating it if needed, or -1 if the name is invalid or no room is left */
+int LightScheduler_defineCalendar(const char *name);
+
+/* Returns the id of the calendar called name, -1 if it does not exist */
+int LightScheduler_findCalendar(const char *name);
+
+/* Adds a date to a calendar. Returns 0, or -1 for an invalid calendar or
+   date, or if the calendar already holds LIGHT_SCHEDULER_CALENDAR_YEARS years */
+int LightScheduler_calendarAddDate(int calendar, int year, int month, int day);
+
+/* Attaches a calendar to an event scheduled at runtime (not to static table
+   events). Returns 0, or -1 for an invalid event or calendar. */
+int LightScheduler_setEventCalendar(int id, int calendar, CalendarMode mode);
+
+/* Light groups: one event switches every light of the group with a single
+   batched driver call (LightControl_onMany/offMany). */
+#define LIGHT_SCHEDULER_MAX_GROUPS 16
+
+/* Define a group from a list of light ids, or from the range first..last.
+   Return the group id (1..LIGHT_SCHEDULER_MAX_GROUPS), -1 on invalid input
+   or when no room is left. */
+int LightScheduler_defineGroup(const int *lightIds, int count);
+int LightScheduler_defineGroupRange(int first, int last);
+
+/* Like LightScheduler_schedule, for every light of a group. Group events are
+   returned by LightScheduler_eventsForLight for each of their lights. */
+int LightScheduler_scheduleGroup(int group, WeekDay day, int minute, int action);
+
+/* Moves the runtime event table into the POSIX shared-memory segment called
+   name (e.g. "/light_scheduler") so that other processes can read it with
+   LightScheduleReader (LightScheduleShm.h) without any IPC. A copy of the
+   static table, if any, of the mask of its removed events, and of the groups
+   and calendars is published too. Returns 0, or -1 if the segment cannot be
+   created, including when a segment of that name already exists (another
+   scheduler's, or a stale one left by a crash: shm_unlink it first). */
+int LightScheduler_share(const char *name);
+
+/* Moves the table back to private memory and unlinks the segment */
+void LightScheduler_unshare(void);
+
+/* Where the scheduler sends its light commands */
+typedef struct {
+    void (*on)(int id);
+    void (*off)(int id);
+    void (*onMany)(const LightSet *lights);
+    void (*offMany)(const LightSet *lights);
+} LightDriver;
+
+/* Redirects the scheduler's output (wakeup, reconcile, turn_*_led_now);
+   NULL restores LightControl */
+void LightScheduler_setDriver(const LightDriver *driver);
+
+/* Number of committed edits of the schedule since startup */
+uint32_t LightScheduler_version(void);
+
+typedef struct {
+    int events;             // Active runtime events (including group events)
+    int staticEvents;       // Unmasked events of the static table
+    int freeSlots;          // Runtime events that can still be scheduled
+    int groups;
+    int calendars;
+    uint32_t version;       // Same as LightScheduler_version()
+} LightSchedulerStats;
+
+void LightScheduler_getStats(LightSchedulerStats *out);
+
+/* Handles of events of a static table are offset by this value, so that
+   LightScheduler_remove and the query functions can tell them apart. */
+#define LIGHT_SCHEDULER_STATIC_BASE 256
+
+/* Handles of runtime events are slot | generation << 9. A slot freed by
+   LightScheduler_remove is reused under the next generation, so a stale
+   handle is ignored instead of reaching the new event of the slot. init and
+   clear start over from generation 0 (handle == slot). */
+#define LIGHT_SCHEDULER_GENERATION_SHIFT 9
+
+/* Like LightScheduler_init, but runs from a read-only table instead of
+   scheduling its events one by one: nothing is copied or sorted at startup.
+   Events scheduled afterwards go to a mutable overlay and fire after the
+   static events of the same minute. Removing a static event only masks it. */
+void LightScheduler_initStatic(const LightScheduleTable *table);
+
+/* Like LightScheduler_clear, but the scheduler then runs from table as after
+   LightScheduler_initStatic (driver and alarm are left alone) */
+void LightScheduler_loadStatic(const LightScheduleTable *table);
 #endif
@@ -0,0 +1,57 @@
+#ifndef LIGHT_SCHEDULER_CHECK_H
+#define LIGHT_SCHEDULER_CHECK_H
+
+#include "LightScheduler.h"
+#include <stdbool.h>
+#include <stdio.h>
+
+/* Randomized differential checker. It drives the scheduler and a reference
+   implementation of its semantics (the plain wakeup loop over every event
+   slot with matches_day, no index) through generated schedules and weeks of
+   virtual time. Part of the events of a case may come from a static table
+   built in memory like tools/generate_schedule.rb output, and the last ops
+   may be folded into one LightScheduler_apply call. It compares the driver
+   commands of every tick (each event minute and the minutes around it),
+   stateAt and the query functions, and stops at the first divergence with a
+   minimized reproduction. The checker clears the scheduler and replaces its
+   driver while it runs: use it from tests or a bench binary, not in service. */
+
+#define LIGHT_CHECK_MAX_OPS 48
+
+typedef enum {
+    CHECK_SCHEDULE,         // LightScheduler_schedule(target, day, minute, action)
+    CHECK_SCHEDULE_GROUP,   // LightScheduler_scheduleGroup(target, day, minute, action)
+    CHECK_REMOVE,           // LightScheduler_remove(handle returned by op target)
+    CHECK_SET_CALENDAR      // LightScheduler_setEventCalendar(handle of op target, calendar, mode)
+} LightCheckOpKind;
+
+typedef struct {
+    LightCheckOpKind kind;
+    int target;             // Light id, group id, or index of an earlier op (-1: none)
+    WeekDay day;
+    int minute;
+    Action action;
+    int calendar;
+    CalendarMode mode;
+    bool inStaticTable;     // CHECK_SCHEDULE only: loaded with the static table instead
+} LightCheckOp;
+
+typedef struct {
+    long cases;             // Cases run
+    long ticks;             // Virtual minutes compared
+    bool diverged;
+    unsigned caseSeed;      // Seed of the failing case (groups, calendars, dates)
+    char divergence[192];   // First difference seen in the minimized case
+    int opCount;
+    LightCheckOp ops[LIGHT_CHECK_MAX_OPS];  // Minimized reproduction
+    int applyFrom;          // ops[applyFrom..] went through LightScheduler_apply (opCount: none)
+} LightCheckReport;
+
+/* Runs cases random cases derived from seed. Returns 0 if the scheduler
+   matched the reference everywhere, 1 on the first divergence. */
+int LightSchedulerCheck_run(unsigned seed, long cases, LightCheckReport *report);
+
+/* Prints the summary, and the reproduction if a divergence was found */
+void LightSchedulerCheck_print(const LightCheckReport *report, FILE *out);
+
+#endif
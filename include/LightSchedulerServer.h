@@ -0,0 +1,57 @@
+#ifndef LIGHT_SCHEDULER_SERVER_H
+#define LIGHT_SCHEDULER_SERVER_H
+
+/* Optional Unix-domain socket front end to the scheduler. Tools connect to
+   the socket and send fixed-size binary requests; they may pipeline any
+   number of them without waiting, and get one response per request, in
+   order. A tool may shut down its sending side after its last request: the
+   server still answers every request before closing the connection. All integers are in host byte order (the socket is local).
+
+   Request, 12 bytes:
+     [0]     op          LSS_OP_*
+     [1]     action      TURN_ON / TURN_OFF (SCHEDULE, TURN_NOW)
+     [2..3]  lightId     uint16 (SCHEDULE, QUERY_LIGHT, TURN_NOW)
+     [4..5]  day         int16 WeekDay (SCHEDULE, QUERY_RANGE)
+     [6..7]  minute      int16 (SCHEDULE), first minute (QUERY_RANGE)
+     [8..11] arg         int32 event id (REMOVE), last minute (QUERY_RANGE)
+
+   Response, 8 bytes followed by count int32 values:
+     [0]     op          op of the request
+     [1]     status      0 on success, 1 on error (e.g. REMOVE of an unknown id)
+     [2..3]  count       uint16 number of int32 values that follow
+     [4..7]  value       int32 event id (SCHEDULE), number of ids (queries)
+     QUERY_LIGHT / QUERY_RANGE: the event ids
+     STATS: events, staticEvents, freeSlots, groups, calendars, version */
+enum {
+    LSS_OP_SCHEDULE = 1,
+    LSS_OP_REMOVE,
+    LSS_OP_QUERY_LIGHT,
+    LSS_OP_QUERY_RANGE,
+    LSS_OP_STATS,
+    LSS_OP_TURN_NOW
+};
+
+#define LSS_REQUEST_SIZE 12
+#define LSS_RESPONSE_HEADER_SIZE 8
+#define LSS_MAX_CLIENTS 8
+
+/* Requests handled per LightSchedulerServer_poll call, so that a burst of
+   edits never holds the loop long enough to delay a tick */
+#define LSS_POLL_BUDGET 256
+
+/* Listens on the socket at path. A socket left there by a daemon that
+   crashed is replaced; returns -1 if another daemon still listens on path or
+   if path is not a socket, without touching it. Returns 0 or -1. */
+int LightSchedulerServer_open(const char *path);
+
+/* Waits at most timeoutMs for socket activity, then accepts clients and
+   serves up to LSS_POLL_BUDGET requests, split evenly between the clients
+   that sent some (the first one served rotates). Meant to be called in the
+   daemon's loop between TimeService alarms; an alarm interrupting the wait
+   just makes it return early. Returns the number of requests served, -1 on
+   error. */
+int LightSchedulerServer_poll(int timeoutMs);
+
+void LightSchedulerServer_close(void);
+
+#endif
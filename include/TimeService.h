@@ -18,6 +18,8 @@ typedef enum {
 typedef struct {
     WeekDay dayOfWeek;
     int minuteOfDay;
+    int year;       /* Calendar date, used by exception calendars. */
+    int dayOfYear;  /* 1..366; year is 0 when the date is unknown. */
 } Time;
 
 /* Initialize time service */
@@ -5,6 +5,7 @@
 static int id_test = -1;        // Stores last operated light ID (LIGHT_ID_UNKNOWN = -1)
 static int state_test = -1;     // Stores last light operation state (LIGHT_STATE_UNKNOWN = -1)
 static int passed_by_me = 0;    // Flag for driver integration testing verification
+static int batch_count = 0;     // Number of batched (onMany/offMany) calls since init
 
 // Get last operated light ID from spy
 int LightControlSpy_getLastLightId(){
@@ -21,6 +22,7 @@ void LightControl_init(){
     id_test    = LIGHT_ID_UNKNOWN;      // Reset to default unknown ID
     state_test = LIGHT_STATE_UNKNOWN;   // Reset to default unknown state
     passed_by_me = 1;                   // Set verification flag for initialization
+    batch_count = 0;                    // Reset batched call counter
 }
 
 // Cleanup spy and print destruction message
@@ -29,6 +31,7 @@ void LightControl_destroy(){
     state_test = LIGHT_STATE_UNKNOWN;   // Reset state tracking
     id_test    = LIGHT_ID_UNKNOWN;      // Reset ID tracking
     passed_by_me = 1;                   // Set verification flag for destruction
+    batch_count = 0;                    // Reset batched call counter
 }
 
 // Spy implementation of light ON operation
@@ -44,6 +47,31 @@ void LightControl_off(int id){
     passed_by_me = 1;          // Set verification flag for driver integration
 }
 
+// Record a batched operation: the last light of the set becomes the last ID
+static void record_batch(const LightSet *lights, int state){
+    for(int id = 0; id < 256; id++){
+        if((lights->bits[id >> 5] >> (id & 31)) & 1u) id_test = id;
+    }
+    state_test = state;        // Record operation
+    batch_count++;             // Count one driver call for the whole set
+    passed_by_me = 1;          // Set verification flag for driver integration
+}
+
+// Spy implementation of batched light ON operation
+void LightControl_onMany(const LightSet *lights){
+    record_batch(lights, LIGHT_ON);
+}
+
+// Spy implementation of batched light OFF operation
+void LightControl_offMany(const LightSet *lights){
+    record_batch(lights, LIGHT_OFF);
+}
+
+// Get number of batched driver calls since last init
+int LightControlSpy_getBatchCount(){
+    return batch_count;
+}
+
 // Check if control path was executed (for driver integration tests)
 int did_you_pass_by_me(){
     return passed_by_me==1;    // Return true if any control operation occurred
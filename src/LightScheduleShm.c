@@ -0,0 +1,152 @@
+#define _POSIX_C_SOURCE 200809L
+#include "LightScheduleShm.h"
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Create the named segment and map it read-write. A segment that already
+// exists belongs to another scheduler (or to one that crashed): never take it over.
+LightScheduleSegment *LightScheduleShm_create(const char *name) {
+    if(name == NULL || name[0] != '/') return NULL;
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if(fd < 0) return NULL;
+    if(ftruncate(fd, sizeof(LightScheduleSegment)) < 0) {
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, sizeof(LightScheduleSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);  // The mapping keeps the segment alive
+    if(map == MAP_FAILED) return NULL;
+
+    LightScheduleSegment *segment = map;
+    segment->sequence = 1;          // Not readable until the scheduler publishes it
+    segment->magic = LIGHT_SCHEDULE_SHM_MAGIC;
+    segment->eventSize = sizeof(ScheduledEvent);
+    segment->capacity = LIGHT_SCHEDULER_MAX_EVENTS;
+    return segment;
+}
+
+// Unmap and unlink the segment, readers keep their mapping until they close
+void LightScheduleShm_destroy(LightScheduleSegment *segment, const char *name) {
+    if(segment != NULL) munmap(segment, sizeof(LightScheduleSegment));
+    if(name != NULL) shm_unlink(name);
+}
+
+int LightScheduleReader_open(LightScheduleReader *reader, const char *name) {
+    struct stat st;
+    if(reader == NULL || name == NULL) return -1;
+    reader->segment = NULL;
+    int fd = shm_open(name, O_RDONLY, 0);
+    if(fd < 0) return -1;
+    if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(LightScheduleSegment)) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, sizeof(LightScheduleSegment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) return -1;
+
+    const LightScheduleSegment *segment = map;
+    if(segment->magic != LIGHT_SCHEDULE_SHM_MAGIC || segment->eventSize != sizeof(ScheduledEvent)
+       || segment->capacity != LIGHT_SCHEDULER_MAX_EVENTS) {
+        munmap(map, sizeof(LightScheduleSegment));
+        return -1;
+    }
+    reader->segment = segment;
+    return 0;
+}
+
+uint32_t LightScheduleReader_version(const LightScheduleReader *reader) {
+    return reader->segment->version;
+}
+
+// The tables of the segment a snapshot can copy
+typedef enum { TABLE_EVENTS, TABLE_STATIC, TABLE_GROUPS, TABLE_CALENDARS } SegmentTable;
+
+// Seqlock read of one table: retry while the writer is active or finished an
+// edit meanwhile, but give up on a writer that never leaves its edit
+// (crashed, or never published the segment)
+static int read_table(const LightScheduleReader *reader, SegmentTable table, void *out,
+                      int max, uint32_t *removed, uint32_t *version) {
+    if(reader == NULL || reader->segment == NULL || out == NULL || max < 0) return -1;
+    const LightScheduleSegment *segment = reader->segment;
+    for(int attempt = 0; attempt < LIGHT_SCHEDULE_READ_ATTEMPTS; attempt++) {
+        uint32_t begin = segment->sequence;
+        __sync_synchronize();
+        if(begin & 1u) {
+            sched_yield();
+            continue;
+        }
+        const void *source;
+        int count, capacity;
+        size_t size;
+        switch(table) {
+        case TABLE_EVENTS:
+            source = segment->events;
+            count = segment->eventCount;
+            capacity = LIGHT_SCHEDULER_MAX_EVENTS;
+            size = sizeof(ScheduledEvent);
+            break;
+        case TABLE_STATIC:
+            source = segment->staticEvents;
+            count = segment->staticEventCount;
+            capacity = 256;
+            size = sizeof(ScheduledEvent);
+            break;
+        case TABLE_GROUPS:
+            source = segment->groups;
+            count = segment->groupCount;
+            capacity = LIGHT_SCHEDULER_MAX_GROUPS;
+            size = sizeof(LightSet);
+            break;
+        default:
+            source = segment->calendars;
+            count = segment->calendarCount;
+            capacity = LIGHT_SCHEDULER_MAX_CALENDARS;
+            size = sizeof(LightScheduleCalendar);
+            break;
+        }
+        if(count < 0 || count > capacity) count = 0;  // Torn read, the check below retries
+        if(count > max) count = max;
+        memcpy(out, source, count * size);
+        uint32_t mask[8];
+        memcpy(mask, segment->staticRemoved, sizeof(mask));
+        uint32_t v = segment->version;
+        __sync_synchronize();
+        if(segment->sequence == begin) {
+            if(removed != NULL) memcpy(removed, mask, sizeof(mask));
+            if(version != NULL) *version = v;
+            return count;
+        }
+    }
+    return -1;
+}
+
+int LightScheduleReader_snapshot(const LightScheduleReader *reader, ScheduledEvent *out,
+                                 int max, uint32_t *version) {
+    return read_table(reader, TABLE_EVENTS, out, max, NULL, version);
+}
+
+int LightScheduleReader_snapshotStatic(const LightScheduleReader *reader, ScheduledEvent *out,
+                                       int max, uint32_t *removed, uint32_t *version) {
+    return read_table(reader, TABLE_STATIC, out, max, removed, version);
+}
+
+int LightScheduleReader_snapshotGroups(const LightScheduleReader *reader, LightSet *out,
+                                       int max, uint32_t *version) {
+    return read_table(reader, TABLE_GROUPS, out, max, NULL, version);
+}
+
+int LightScheduleReader_snapshotCalendars(const LightScheduleReader *reader,
+                                          LightScheduleCalendar *out, int max, uint32_t *version) {
+    return read_table(reader, TABLE_CALENDARS, out, max, NULL, version);
+}
+
+void LightScheduleReader_close(LightScheduleReader *reader) {
+    if(reader == NULL || reader->segment == NULL) return;
+    munmap((void *)reader->segment, sizeof(LightScheduleSegment));
+    reader->segment = NULL;
+}
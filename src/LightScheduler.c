@@ -1,20 +1,200 @@
 #include "LightScheduler.h"
 #include "LightControl.h"
+#include "LightScheduleShm.h"
 #include "TimeService.h"
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+
+// Output of the scheduler, LightControl unless replaced by LightScheduler_setDriver
+static const LightDriver lightControlDriver = {
+    LightControl_on, LightControl_off, LightControl_onMany, LightControl_offMany
+};
+static const LightDriver *driver = &lightControlDriver;
 
 // Global variables for storing scheduled events
-static ScheduledEvent events[256];  // Stores up to 256 scheduled light events
+static ScheduledEvent eventStorage[LIGHT_SCHEDULER_MAX_EVENTS];   // Runtime events (the overlay of a static table)
+static ScheduledEvent *events = eventStorage; // Points into the shared segment once shared
 static int eventCount = 0;          // Tracks number of active scheduled events
 
+// Secondary indexes kept in sync with events[] by schedule/remove
+#define GROUP_LISTS 256             // lightHead/lightTail entry 256 + g - 1 lists the events of group g
+#define LIST_COUNT (GROUP_LISTS + LIGHT_SCHEDULER_MAX_GROUPS)
+static int lightHead[LIST_COUNT];   // First active event of each light or group (-1 if none)
+static int lightTail[LIST_COUNT];   // Last active event of each light or group (-1 if none)
+#define NO_LIGHT -1                 // lightId of group events
+static int dayIndex[7][LIGHT_SCHEDULER_MAX_EVENTS];    // Active events firing on each day, ordered by minute then scheduling order
+static int dayCount[7];             // Number of entries used in each dayIndex row
+static bool overlayReady = false;   // lightHead/lightTail are reset lazily after initStatic
+static int freeSlots[LIGHT_SCHEDULER_MAX_EVENTS];      // Slots of removed events, reused once events[] is full
+static int freeCount = 0;
+static uint32_t nextOrder = 0;      // Scheduling order of the next runtime event
+
+// Ticks arriving while the table is being edited are deferred to the end of the edit
+static volatile sig_atomic_t writeDepth = 0;
+static volatile sig_atomic_t tickPending = 0;
+static uint32_t tableVersion = 0;   // Incremented by every committed edit
+static bool tableChanged = false;   // The current write section has changed the table
+
+// Shared-memory segment holding events[] while LightScheduler_share is active
+static LightScheduleSegment *segment = NULL;
+static char segmentName[64];
+
+// Per-light transition index used by LightScheduler_stateAt, rebuilt lazily
+// after the schedule changes. transitions[transitionStart[l] .. transitionStart[l+1])
+// holds the firings of light l ordered by minute of the week, then as in the day rows.
+static ScheduleTransition transitions[7*LIGHT_SCHEDULER_MAX_EVENTS];
+static int transitionStart[257];
+static bool transitionsDirty = true;
+
+// Read-only table installed by LightScheduler_initStatic, and its masked events
+static const LightScheduleTable *staticTable = NULL;
+static uint32_t staticRemoved[8];
+
+#define WEEK_MINUTES (7*24*60)
+#define MAX_LIVE_EVENTS (256 + LIGHT_SCHEDULER_MAX_EVENTS)
+#define GENERATION_MASK 0x3fffff    // Keeps handles positive
+
+// Exception calendars: one day bitmap per year, bit (dayOfYear - 1)
+static LightScheduleCalendar calendars[LIGHT_SCHEDULER_MAX_CALENDARS];   // Calendar id c is calendars[c - 1]
+static int calendarCount = 0;
+
+static LightSet groups[LIGHT_SCHEDULER_MAX_GROUPS];         // Group id g is groups[g - 1]
+static uint16_t lightGroups[256];   // Bit g - 1 is set when the light belongs to group g
+static int groupCount = 0;
+
+// Firings of group events, ordered by minute of the week then event id
+static ScheduleTransition groupTransitions[7*LIGHT_SCHEDULER_MAX_EVENTS];
+static int groupTransitionCount = 0;
+
+static void reset_groups(void) {
+    memset(lightGroups, 0, sizeof(lightGroups));
+    groupCount = 0;
+}
+
+static bool bit_test(const uint32_t *bits, int i) {
+    return bits != NULL && ((bits[i >> 5] >> (i & 31)) & 1u);
+}
+
+// Copy the groups and calendars to a segment (a few KB, only on committed edits)
+static void publish_definitions(LightScheduleSegment *target) {
+    target->groupCount = groupCount;
+    memcpy(target->groups, groups, groupCount * sizeof(LightSet));
+    target->calendarCount = calendarCount;
+    memcpy(target->calendars, calendars, calendarCount * sizeof(LightScheduleCalendar));
+}
+
+static void begin_write(void) {
+    writeDepth++;
+}
+
+// Called before each change of the table: the first one of a write section
+// makes the seqlock of the shared segment odd
+static void mark_changed(void) {
+    if(tableChanged) return;
+    tableChanged = true;
+    if(segment != NULL) {
+        segment->sequence++;
+        __sync_synchronize();
+    }
+}
+
+// Only write sections that changed the table commit a new version, so that
+// rejected or empty edits are invisible to readers polling the version
+static void end_write(void) {
+    if(writeDepth > 1) {
+        writeDepth--;
+        return;
+    }
+    if(tableChanged) {
+        tableChanged = false;
+        tableVersion++;
+        if(segment != NULL) {
+            segment->eventCount = eventCount;
+            memcpy(segment->staticRemoved, staticRemoved, sizeof(staticRemoved));
+            publish_definitions(segment);
+            segment->version = tableVersion;
+            __sync_synchronize();
+            segment->sequence++;
+        }
+    }
+    writeDepth = 0;
+    if(tickPending) {
+        tickPending = 0;
+        LightScheduler_wakeup();
+    }
+}
+
+// Copy the static table to the shared segment, if any (its mask is copied
+// by end_write)
+static void publish_static(void) {
+    if(segment == NULL) return;
+    int count = (staticTable != NULL) ? staticTable->eventCount : 0;
+    segment->staticEventCount = count;
+    if(count > 0) memcpy(segment->staticEvents, staticTable->events, count * sizeof(ScheduledEvent));
+}
+
+// Reset the mutable event table and its indexes
+static void reset_overlay(void) {
+    if(eventCount > 0) mark_changed();
+    eventCount = 0;
+    freeCount = 0;
+    for(int i = 0; i < LIGHT_SCHEDULER_MAX_EVENTS; i++) {
+        events[i].active = false;  // Initialize all event slots as inactive
+        events[i].generation = 0;
+    }
+    for(int i = 0; i < LIST_COUNT; i++) {
+        lightHead[i] = -1;
+        lightTail[i] = -1;
+    }
+    for(int d = 0; d < 7; d++) dayCount[d] = 0;
+    nextOrder = 0;
+    transitionsDirty = true;
+    overlayReady = true;
+}
+
 // Initialize light scheduler - reset event count and mark all events inactive
 void LightScheduler_init(void) {
     LightControl_init();
+    LightScheduler_clear();
+    TimeService_startPeriodicAlarm(60,LightScheduler_wakeup);
+}
+
+// Forget every event, group and calendar, leaving the driver and alarm alone
+void LightScheduler_clear(void) {
+    begin_write();                  // A tick meanwhile waits for the events to be gone too
+    if(staticTable != NULL || groupCount > 0 || calendarCount > 0) mark_changed();
+    calendarCount = 0;
+    reset_groups();
+    staticTable = NULL;
+    memset(staticRemoved, 0, sizeof(staticRemoved));
+    publish_static();
+    reset_overlay();
+    end_write();
+}
+
+// Run from a read-only table: only the counters are reset, the overlay
+// indexes are cleared on the first runtime edit
+void LightScheduler_loadStatic(const LightScheduleTable *table) {
+    begin_write();
+    calendarCount = 0;
+    reset_groups();
+    mark_changed();
+    staticTable = table;
+    memset(staticRemoved, 0, sizeof(staticRemoved));
+    publish_static();
     eventCount = 0;
-    for(int i = 0; i < 256; i++) {
-        events[i].active = false;  // Initialize all event slots as inactive
-    }
+    freeCount = 0;
+    for(int d = 0; d < 7; d++) dayCount[d] = 0;
+    transitionsDirty = true;
+    overlayReady = false;
+    end_write();
+}
+
+void LightScheduler_initStatic(const LightScheduleTable *table) {
+    LightControl_init();
+    LightScheduler_loadStatic(table);
     TimeService_startPeriodicAlarm(60,LightScheduler_wakeup);
 }
 
@@ -23,27 +203,373 @@ void LightScheduler_destroy(void) {
     LightControl_destroy();
 }
 
-// Schedule a new light event with validation
-int LightScheduler_schedule(int lightId, WeekDay day, int minute, int action) {
-    // Validate light ID range and check event capacity
-    if(lightId < 0 || lightId > 255 || eventCount >= 256) return -1;
-    if(minute<0 || minute>23*60+59)return -1;
+// Move events[] into a named shared-memory segment that readers can map
+int LightScheduler_share(const char *name) {
+    if(name == NULL || strlen(name) >= sizeof(segmentName)) return -1;
+    if(segment != NULL) LightScheduler_unshare();
+    LightScheduleSegment *created = LightScheduleShm_create(name);
+    if(created == NULL) return -1;
+    memcpy(created->events, eventStorage, sizeof(eventStorage));
+    created->eventCount = eventCount;
+    created->version = tableVersion;
+    memcpy(created->staticRemoved, staticRemoved, sizeof(staticRemoved));
+    publish_definitions(created);
+    created->staticEventCount = (staticTable != NULL) ? staticTable->eventCount : 0;
+    if(staticTable != NULL)
+        memcpy(created->staticEvents, staticTable->events, staticTable->eventCount * sizeof(ScheduledEvent));
+    __sync_synchronize();
+    created->sequence++;            // Even: the table is published
+    strcpy(segmentName, name);
+    events = created->events;
+    segment = created;
+    return 0;
+}
+
+// Bring events[] back to private memory and remove the segment
+void LightScheduler_unshare(void) {
+    if(segment == NULL) return;
+    memcpy(eventStorage, segment->events, sizeof(eventStorage));
+    events = eventStorage;
+    LightScheduleShm_destroy(segment, segmentName);
+    segment = NULL;
+}
+
+void LightScheduler_setDriver(const LightDriver *replacement) {
+    driver = (replacement != NULL) ? replacement : &lightControlDriver;
+}
+
+uint32_t LightScheduler_version(void) {
+    return tableVersion;
+}
+
+// The mutable table seen through the same structure as a static one
+static LightScheduleTable overlay_view(void) {
+    LightScheduleTable t = {
+        .events = events,
+        .eventCount = eventCount,
+        .lightHead = overlayReady ? lightHead : NULL,
+        .transitions = transitions,
+        .transitionStart = transitionStart
+    };
+    for(int d = 0; d < 7; d++) {
+        t.dayIndex[d] = dayIndex[d];
+        t.dayCount[d] = dayCount[d];
+    }
+    return t;
+}
+
+// Firing order of two events: by minute, then by scheduling order (runtime
+// events, whose slots are reused), then by id (static tables, order 0)
+static bool fires_before(const ScheduledEvent *a, const ScheduledEvent *b) {
+    if(a->minute != b->minute) return a->minute < b->minute;
+    if(a->order != b->order) return a->order < b->order;
+    return a->id < b->id;
+}
+
+// Position of the first entry of a day row firing at or after minute
+static int day_index_first(const LightScheduleTable *t, int row, int minute) {
+    int lo = 0, hi = t->dayCount[row];
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(t->events[t->dayIndex[row][mid]].minute < minute) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Position of the first entry of a day row firing after e
+static int day_index_upper_bound(const LightScheduleTable *t, int row, const ScheduledEvent *e) {
+    int lo = 0, hi = t->dayCount[row];
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(!fires_before(e, &t->events[t->dayIndex[row][mid]])) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Group events are linked into their group's list, not into every light's list
+static int list_of(const ScheduledEvent *e) {
+    return (e->group != 0) ? GROUP_LISTS + e->group - 1 : e->lightId;
+}
+
+// Add an event to the per-light list and to the row of every day it fires on
+static void index_event(ScheduledEvent *e) {
+    LightScheduleTable t = overlay_view();
+    int list = list_of(e);
+    e->prevForLight = lightTail[list];
+    e->nextForLight = -1;
+    if(e->prevForLight >= 0) events[e->prevForLight].nextForLight = e->id;
+    else lightHead[list] = e->id;
+    lightTail[list] = e->id;
+
+    for(int row = 0; row < 7; row++) {
+        if(!matches_day(e->day, (WeekDay)(MONDAY + row))) continue;
+        int pos = day_index_upper_bound(&t, row, e);
+        memmove(&dayIndex[row][pos + 1], &dayIndex[row][pos],
+                (dayCount[row] - pos) * sizeof(int));
+        dayIndex[row][pos] = e->id;
+        dayCount[row]++;
+    }
+    transitionsDirty = true;
+}
+
+// Remove an event from the indexes it was added to by index_event
+static void unindex_event(ScheduledEvent *e) {
+    LightScheduleTable t = overlay_view();
+    int list = list_of(e);
+    if(e->prevForLight >= 0) events[e->prevForLight].nextForLight = e->nextForLight;
+    else lightHead[list] = e->nextForLight;
+    if(e->nextForLight >= 0) events[e->nextForLight].prevForLight = e->prevForLight;
+    else lightTail[list] = e->prevForLight;
+
+    for(int row = 0; row < 7; row++) {
+        if(!matches_day(e->day, (WeekDay)(MONDAY + row))) continue;
+        int pos = day_index_upper_bound(&t, row, e) - 1;  // e is the last entry not after itself
+        memmove(&dayIndex[row][pos], &dayIndex[row][pos + 1],
+                (dayCount[row] - pos - 1) * sizeof(int));
+        dayCount[row]--;
+    }
+    transitionsDirty = true;
+}
+
+static bool valid_entry(int lightId, int minute) {
+    return lightId >= 0 && lightId <= 255 && minute >= 0 && minute <= 23*60+59;
+}
+
+static bool valid_group(int group) {
+    return group >= 1 && group <= groupCount;
+}
+
+// Handle of a runtime event
+static int handle_of(const ScheduledEvent *e) {
+    return (e->generation << LIGHT_SCHEDULER_GENERATION_SHIFT) | e->id;
+}
+
+static bool is_static_handle(int id) {
+    return id >= LIGHT_SCHEDULER_STATIC_BASE && id < 2 * LIGHT_SCHEDULER_STATIC_BASE;
+}
+
+// Slot of the live runtime event a handle refers to, -1 if invalid or stale
+static int slot_of(int id) {
+    if(id < 0 || (id & LIGHT_SCHEDULER_STATIC_BASE)) return -1;
+    int slot = id & (LIGHT_SCHEDULER_STATIC_BASE - 1);
+    if(slot >= eventCount || !events[slot].active) return -1;
+    return (events[slot].generation == id >> LIGHT_SCHEDULER_GENERATION_SHIFT) ? slot : -1;
+}
+
+// Slots available to new events: never used ones first, then removed ones
+static int free_slot_count(void) {
+    return (LIGHT_SCHEDULER_MAX_EVENTS - eventCount) + freeCount;
+}
+
+static int schedule_event(const ScheduleEntry *entry) {
+    if(!overlayReady) reset_overlay();
+    int slot;
+    if(eventCount < LIGHT_SCHEDULER_MAX_EVENTS) slot = eventCount++;
+    else if(freeCount > 0) slot = freeSlots[--freeCount];
+    else return -1;
+    int generation = events[slot].generation;   // Bumped when the previous event was removed
+    mark_changed();
     // Create new event and add to array
-    events[eventCount] = (ScheduledEvent){
-        .id = eventCount,          // Auto-increment ID based on position
-        .lightId = lightId,        // Target light ID (0-255)
-        .day = day,                // Scheduled day/week pattern
-        .minute = minute,          // Scheduled time in minutes
-        .action = action,          // TURN_ON (1) or TURN_OFF (0)
+    events[slot] = (ScheduledEvent){
+        .id = slot,                // ID is the position in events[]
+        .lightId = entry->group ? NO_LIGHT : entry->lightId,  // Target light ID (0-255)
+        .day = entry->day,         // Scheduled day/week pattern
+        .minute = entry->minute,   // Scheduled time in minutes
+        .action = entry->action,   // TURN_ON (1) or TURN_OFF (0)
         .active = true,            // Mark event as active
-        .one_minute_befores = true // Currently unused legacy flag
+        .one_minute_befores = true,// Currently unused legacy flag
+        .calendar = entry->calendar,
+        .calendarMode = entry->calendarMode,
+        .group = entry->group,     // Target group, 0 for a single light
+        .generation = generation,
+        .order = nextOrder++       // Breaks ties with the events of the same minute
     };
-    return eventCount++;  // Return event ID and increment counter
+    index_event(&events[slot]);
+    return handle_of(&events[slot]);
+}
+
+static void remove_slot(int slot) {
+    mark_changed();
+    events[slot].active = false;  // Soft delete by deactivation
+    unindex_event(&events[slot]);
+    events[slot].generation = (events[slot].generation + 1) & GENERATION_MASK;
+    freeSlots[freeCount++] = slot;
+}
+
+static int remove_event(int id) {
+    if(is_static_handle(id)) {
+        int slot = id - LIGHT_SCHEDULER_STATIC_BASE;
+        if(staticTable == NULL || slot >= staticTable->eventCount || bit_test(staticRemoved, slot)) return -1;
+        mark_changed();
+        staticRemoved[slot >> 5] |= 1u << (slot & 31);
+        return 0;
+    }
+    int slot = slot_of(id);
+    if(slot < 0) return -1;
+    remove_slot(slot);
+    return 0;
+}
+
+// Schedule a new light event with validation
+int LightScheduler_schedule(int lightId, WeekDay day, int minute, int action) {
+    // Validate light ID range, time and event capacity
+    if(!valid_entry(lightId, minute) || free_slot_count() == 0) return -1;
+    begin_write();
+    int id = schedule_event(&(ScheduleEntry){
+        .lightId = lightId, .day = day, .minute = minute, .action = action });
+    end_write();
+    return id;  // Return event ID
+}
+
+// Schedule an event switching every light of a group at once
+int LightScheduler_scheduleGroup(int group, WeekDay day, int minute, int action) {
+    if(!valid_group(group) || !valid_entry(0, minute) || free_slot_count() == 0) return -1;
+    begin_write();
+    int id = schedule_event(&(ScheduleEntry){
+        .group = group, .day = day, .minute = minute, .action = action });
+    end_write();
+    return id;
+}
+
+static int add_group(const LightSet *lights) {
+    if(groupCount >= LIGHT_SCHEDULER_MAX_GROUPS) return -1;
+    begin_write();
+    mark_changed();
+    groups[groupCount] = *lights;
+    for(int l = 0; l < 256; l++) {
+        if(bit_test(lights->bits, l)) lightGroups[l] |= 1u << groupCount;
+    }
+    int id = ++groupCount;
+    end_write();
+    return id;
 }
 
-// Remove/deactivate an event by ID
-void LightScheduler_remove(int id) {
-    if(id >= 0 && id < 256) events[id].active = false;  // Soft delete by deactivation
+int LightScheduler_defineGroup(const int *lightIds, int count) {
+    LightSet lights = {{0}};
+    if(lightIds == NULL || count <= 0) return -1;
+    for(int i = 0; i < count; i++) {
+        if(lightIds[i] < 0 || lightIds[i] > 255) return -1;
+        lights.bits[lightIds[i] >> 5] |= 1u << (lightIds[i] & 31);
+    }
+    return add_group(&lights);
+}
+
+int LightScheduler_defineGroupRange(int first, int last) {
+    LightSet lights = {{0}};
+    if(first < 0 || last > 255 || first > last) return -1;
+    for(int id = first; id <= last; id++) {
+        lights.bits[id >> 5] |= 1u << (id & 31);
+    }
+    return add_group(&lights);
+}
+
+// Remove/deactivate an event by ID (static events are masked, not deleted)
+int LightScheduler_remove(int id) {
+    begin_write();
+    int result = remove_event(id);
+    end_write();
+    return result;
+}
+
+static bool valid_calendar(int calendar) {
+    return calendar >= 1 && calendar <= calendarCount;
+}
+
+static bool same_event(const ScheduledEvent *e, const ScheduleEntry *entry) {
+    if(e->group != entry->group) return false;
+    if(e->day != entry->day || e->minute != entry->minute || e->action != entry->action) return false;
+    if(e->calendarMode != entry->calendarMode) return false;
+    return entry->calendarMode == CALENDAR_NONE || e->calendar == entry->calendar;
+}
+
+// Diff entries against the live events through the per-light lists, then
+// apply only the differences inside one write section
+int LightScheduler_apply(const ScheduleEntry *entries, int count, int *handles) {
+    // At most a full static table plus a full overlay
+    if(count < 0 || count > MAX_LIVE_EVENTS || (count > 0 && entries == NULL)) return -1;
+    int ids[MAX_LIVE_EVENTS];
+    uint32_t keepStatic[8] = {0};
+    bool keep[LIGHT_SCHEDULER_MAX_EVENTS] = {false};
+    int kept = 0, live = 0;
+
+    for(int i = 0; i < count; i++) {
+        const ScheduleEntry *entry = &entries[i];
+        if(entry->group != 0 ? !valid_group(entry->group) || !valid_entry(0, entry->minute)
+                             : !valid_entry(entry->lightId, entry->minute)) return -1;
+        if(entry->calendarMode != CALENDAR_NONE && !valid_calendar(entry->calendar)) return -1;
+        ids[i] = -1;
+        if(staticTable != NULL && entry->group == 0) {
+            for(int j = staticTable->lightHead[entry->lightId]; j >= 0 && ids[i] < 0;
+                j = staticTable->events[j].nextForLight) {
+                if(!bit_test(staticRemoved, j) && !bit_test(keepStatic, j)
+                   && same_event(&staticTable->events[j], entry)) {
+                    keepStatic[j >> 5] |= 1u << (j & 31);
+                    ids[i] = LIGHT_SCHEDULER_STATIC_BASE + j;
+                }
+            }
+        }
+        if(overlayReady) {
+            int list = (entry->group != 0) ? GROUP_LISTS + entry->group - 1 : entry->lightId;
+            for(int j = lightHead[list]; j >= 0 && ids[i] < 0; j = events[j].nextForLight) {
+                if(!keep[j] && same_event(&events[j], entry)) {
+                    keep[j] = true;
+                    ids[i] = handle_of(&events[j]);
+                    kept++;
+                }
+            }
+        }
+    }
+    for(int j = 0; overlayReady && j < eventCount; j++) {
+        if(events[j].active) live++;
+    }
+    int added = 0;
+    for(int i = 0; i < count; i++) {
+        if(ids[i] < 0) added++;
+    }
+    if(added > free_slot_count() + (live - kept)) return -1;
+
+    int removed = 0;
+    begin_write();
+    if(staticTable != NULL) {
+        for(int j = 0; j < staticTable->eventCount; j++) {
+            if(!bit_test(staticRemoved, j) && !bit_test(keepStatic, j)) {
+                remove_event(LIGHT_SCHEDULER_STATIC_BASE + j);
+                removed++;
+            }
+        }
+    }
+    for(int j = 0; overlayReady && j < eventCount; j++) {
+        if(events[j].active && !keep[j]) {
+            remove_slot(j);
+            removed++;
+        }
+    }
+    for(int i = 0; i < count; i++) {
+        if(ids[i] < 0) {
+            ids[i] = schedule_event(&entries[i]);
+        }
+        if(handles != NULL) handles[i] = ids[i];
+    }
+    end_write();
+    return added + removed;
+}
+
+// Counters for monitoring tools, O(events)
+void LightScheduler_getStats(LightSchedulerStats *out) {
+    if(out == NULL) return;
+    memset(out, 0, sizeof(*out));
+    for(int i = 0; overlayReady && i < eventCount; i++) {
+        if(events[i].active) out->events++;
+    }
+    for(int i = 0; staticTable != NULL && i < staticTable->eventCount; i++) {
+        if(!bit_test(staticRemoved, i)) out->staticEvents++;
+    }
+    out->freeSlots = free_slot_count();
+    out->groups = groupCount;
+    out->calendars = calendarCount;
+    out->version = tableVersion;
 }
 
 // Day matching logic for different schedule types
@@ -54,39 +580,414 @@ bool matches_day(WeekDay scheduled, WeekDay current) {
     return scheduled == current;  // Direct day match
 }
 
-// Main scheduler loop - checks and triggers events
+static bool leap_year(int year) {
+    return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+}
+
+static int days_in_year(int year) {
+    return leap_year(year) ? 366 : 365;
+}
+
+// Date arithmetic is done here, once, when a date is loaded
+static int day_of_year(int year, int month, int day) {
+    static const int daysBefore[12] = { 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334 };
+    static const int monthDays[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    if(month < 1 || month > 12 || day < 1) return -1;
+    int extra = (month == 2 && leap_year(year)) ? 1 : 0;
+    if(day > monthDays[month - 1] + extra) return -1;
+    return daysBefore[month - 1] + day + ((month > 2 && leap_year(year)) ? 1 : 0);
+}
+
+static bool calendar_contains(int calendar, int year, int dayOfYear) {
+    const LightScheduleCalendar *c = &calendars[calendar - 1];
+    if(year == 0 || dayOfYear < 1 || dayOfYear > 366) return false;
+    for(int y = 0; y < c->yearCount; y++) {
+        if(c->years[y] == year) return bit_test(c->days[y], dayOfYear - 1);
+    }
+    return false;
+}
+
+int LightScheduler_findCalendar(const char *name) {
+    if(name == NULL) return -1;
+    for(int c = 0; c < calendarCount; c++) {
+        if(strcmp(calendars[c].name, name) == 0) return c + 1;
+    }
+    return -1;
+}
+
+int LightScheduler_defineCalendar(const char *name) {
+    if(name == NULL || name[0] == '\0' || strlen(name) >= sizeof(calendars[0].name)) return -1;
+    int id = LightScheduler_findCalendar(name);
+    if(id > 0) return id;
+    if(calendarCount >= LIGHT_SCHEDULER_MAX_CALENDARS) return -1;
+    begin_write();
+    mark_changed();
+    LightScheduleCalendar *c = &calendars[calendarCount];
+    memset(c, 0, sizeof(*c));
+    strcpy(c->name, name);
+    id = ++calendarCount;
+    end_write();
+    return id;
+}
+
+int LightScheduler_calendarAddDate(int calendar, int year, int month, int day) {
+    if(!valid_calendar(calendar) || year <= 0) return -1;
+    int dayOfYear = day_of_year(year, month, day);
+    if(dayOfYear < 0) return -1;
+    LightScheduleCalendar *c = &calendars[calendar - 1];
+    int y = 0;
+    while(y < c->yearCount && c->years[y] != year) y++;
+    if(y == c->yearCount && y >= LIGHT_SCHEDULER_CALENDAR_YEARS) return -1;
+    uint32_t bit = 1u << ((dayOfYear - 1) & 31);
+    if(y < c->yearCount && (c->days[y][(dayOfYear - 1) >> 5] & bit)) return 0;   // Already listed
+    begin_write();
+    mark_changed();
+    if(y == c->yearCount) c->years[c->yearCount++] = year;
+    c->days[y][(dayOfYear - 1) >> 5] |= bit;
+    end_write();
+    return 0;
+}
+
+int LightScheduler_setEventCalendar(int id, int calendar, CalendarMode mode) {
+    int slot = slot_of(id);
+    if(slot < 0) return -1;
+    if(mode != CALENDAR_NONE && !valid_calendar(calendar)) return -1;
+    begin_write();
+    mark_changed();
+    events[slot].calendar = calendar;
+    events[slot].calendarMode = mode;
+    transitionsDirty = true;
+    end_write();
+    return 0;
+}
+
+// Bit c-1 is set when calendar c contains the date of now, computed once per tick
+static uint32_t calendars_containing(int year, int dayOfYear) {
+    uint32_t mask = 0;
+    for(int c = 1; c <= calendarCount; c++) {
+        if(calendar_contains(c, year, dayOfYear)) mask |= 1u << (c - 1);
+    }
+    return mask;
+}
+
+// One bit test against the mask of the calendars containing the current date
+static bool calendar_allows(const ScheduledEvent *e, uint32_t today) {
+    if(e->calendarMode == CALENDAR_NONE) return true;
+    bool listed = (today >> (e->calendar - 1)) & 1u;
+    return (e->calendarMode == CALENDAR_ONLY) ? listed : !listed;
+}
+
+static void fire(const ScheduledEvent *e) {
+    if(e->group != 0) {
+        // One batched driver update for the whole group
+        (e->action == TURN_ON) ? driver->onMany(&groups[e->group - 1])
+                               : driver->offMany(&groups[e->group - 1]);
+        return;
+    }
+    (e->action == TURN_ON) ? driver->on(e->lightId)
+                           : driver->off(e->lightId);
+}
+
+// Fire the events of one table due at this minute: binary search the day row
+static void fire_due(const LightScheduleTable *t, int row, int minute,
+                     const uint32_t *removed, uint32_t today) {
+    for(int pos = day_index_first(t, row, minute); pos < t->dayCount[row]; pos++) {
+        const ScheduledEvent *e = &t->events[t->dayIndex[row][pos]];
+        if(e->minute != minute) break;
+        if(!bit_test(removed, e->id) && calendar_allows(e, today)) fire(e);
+    }
+}
+
+// Reference scan, only used for days outside MONDAY..SUNDAY where patterns
+// such as EVERYDAY still match; due events fire in the order of the day rows
+static void fire_due_scan(const LightScheduleTable *t, Time now,
+                          const uint32_t *removed, uint32_t today) {
+    const ScheduledEvent *due[256];
+    int n = 0;
+    for(int i = 0; i < t->eventCount; i++) {
+        const ScheduledEvent *e = &t->events[i];
+        if(e->active && !bit_test(removed, i) && matches_day(e->day, now.dayOfWeek)
+           && e->minute == now.minuteOfDay && calendar_allows(e, today)) {
+            int pos = n++;
+            for(; pos > 0 && fires_before(e, due[pos - 1]); pos--) due[pos] = due[pos - 1];
+            due[pos] = e;
+        }
+    }
+    for(int i = 0; i < n; i++) fire(due[i]);
+}
+
+// Main scheduler loop - triggers the events due now
 void LightScheduler_wakeup(void) {
+    if(writeDepth > 0) {
+        tickPending = 1;  // Fired by end_write once the table is consistent again
+        return;
+    }
     Time timeNow;
     TimeService_getTime(&timeNow);  // Get current time
-    
-    // Check all scheduled events
-    for(int i = 0; i < eventCount; i++) {
-        ScheduledEvent *e = &events[i];
-        // Check if event is active and day matches
-        if(e->active && matches_day(e->day, timeNow.dayOfWeek)) {
-            // Execute action if time matches exactly
-            if(e->minute - timeNow.minuteOfDay == 0) {
-                (e->action == TURN_ON) ? LightControl_on(e->lightId) 
-                                       : LightControl_off(e->lightId);
+    LightScheduler_wakeupAt(timeNow);
+}
+
+// Trigger the events due at timeNow, static table first
+void LightScheduler_wakeupAt(Time timeNow) {
+    LightScheduleTable overlay = overlay_view();
+    uint32_t today = calendars_containing(timeNow.year, timeNow.dayOfYear);
+
+    if(timeNow.dayOfWeek >= MONDAY && timeNow.dayOfWeek <= SUNDAY) {
+        int row = timeNow.dayOfWeek - MONDAY;
+        if(staticTable != NULL) fire_due(staticTable, row, timeNow.minuteOfDay, staticRemoved, today);
+        fire_due(&overlay, row, timeNow.minuteOfDay, NULL, today);
+    } else {
+        if(staticTable != NULL) fire_due_scan(staticTable, timeNow, staticRemoved, today);
+        fire_due_scan(&overlay, timeNow, NULL, today);
+    }
+}
+
+// Walk the intrusive per-light lists: O(events of this light)
+int LightScheduler_eventsForLight(int lightId, int *out, int max) {
+    if(lightId < 0 || lightId > 255 || out == NULL || max < 0) return -1;
+    int n = 0;
+    if(staticTable != NULL) {
+        for(int i = staticTable->lightHead[lightId]; i >= 0 && n < max;
+            i = staticTable->events[i].nextForLight) {
+            if(!bit_test(staticRemoved, i)) out[n++] = LIGHT_SCHEDULER_STATIC_BASE + i;
+        }
+    }
+    if(!overlayReady) return n;
+    for(int i = lightHead[lightId]; i >= 0 && n < max; i = events[i].nextForLight) {
+        out[n++] = handle_of(&events[i]);
+    }
+    for(int g = 0; g < groupCount; g++) {
+        if(!((lightGroups[lightId] >> g) & 1u)) continue;
+        for(int i = lightHead[GROUP_LISTS + g]; i >= 0 && n < max; i = events[i].nextForLight) {
+            out[n++] = handle_of(&events[i]);
+        }
+    }
+    return n;
+}
+
+// Binary search both day rows for the first event at or after from, then
+// merge them by minute until to (static events first inside a minute)
+int LightScheduler_eventsInRange(WeekDay day, int from, int to, int *out, int max) {
+    if(day < MONDAY || day > SUNDAY || out == NULL || max < 0) return -1;
+    if(from < 0 || to > 23*60+59 || from > to) return -1;
+    int row = day - MONDAY;
+    LightScheduleTable overlay = overlay_view();
+    const LightScheduleTable *st = staticTable;
+    int sp = st ? day_index_first(st, row, from) : 0;
+    int se = st ? st->dayCount[row] : 0;
+    int op = day_index_first(&overlay, row, from);
+    int n = 0;
+    while(n < max) {
+        const ScheduledEvent *s = (sp < se) ? &st->events[st->dayIndex[row][sp]] : NULL;
+        const ScheduledEvent *o = (op < overlay.dayCount[row]) ? &events[dayIndex[row][op]] : NULL;
+        if(s != NULL && s->minute > to) s = NULL;
+        if(o != NULL && o->minute > to) o = NULL;
+        if(s == NULL && o == NULL) break;
+        if(s != NULL && (o == NULL || s->minute <= o->minute)) {
+            sp++;
+            if(!bit_test(staticRemoved, s->id)) out[n++] = LIGHT_SCHEDULER_STATIC_BASE + s->id;
+        } else {
+            op++;
+            out[n++] = handle_of(o);
+        }
+    }
+    return n;
+}
+
+// Rebuild the transition index from the day rows. Reading the rows day by day
+// yields firings already ordered by (weekMinute, id), so a stable bucket pass
+// per light keeps them sorted: O(total firings), no sort needed. Group events
+// go to their own list instead of one entry per light of the group.
+static void build_transitions(void) {
+    int count[257] = {0};
+    groupTransitionCount = 0;
+    for(int row = 0; row < 7; row++) {
+        for(int pos = 0; pos < dayCount[row]; pos++) {
+            ScheduledEvent *e = &events[dayIndex[row][pos]];
+            if(e->group != 0) {
+                groupTransitions[groupTransitionCount++] = (ScheduleTransition){
+                    .weekMinute = (int16_t)(row * 24*60 + e->minute),
+                    .slot = (uint8_t)e->id,
+                    .action = (uint8_t)e->action
+                };
+                continue;
             }
+            count[e->lightId + 1]++;
+        }
+    }
+    transitionStart[0] = 0;
+    for(int l = 0; l < 256; l++) transitionStart[l + 1] = transitionStart[l] + count[l + 1];
+
+    int fill[256];
+    memcpy(fill, transitionStart, sizeof(fill));
+    for(int row = 0; row < 7; row++) {
+        for(int pos = 0; pos < dayCount[row]; pos++) {
+            ScheduledEvent *e = &events[dayIndex[row][pos]];
+            if(e->group != 0) continue;
+            transitions[fill[e->lightId]++] = (ScheduleTransition){
+                .weekMinute = (int16_t)(row * 24*60 + e->minute),
+                .slot = (uint8_t)e->id,
+                .action = (uint8_t)e->action
+            };
         }
     }
+    transitionsDirty = false;
+}
+
+// How long before weekMinute transition tr fired, wrapping around the week
+static int transition_age(const ScheduleTransition *tr, int weekMinute) {
+    return (weekMinute - tr->weekMinute + WEEK_MINUTES) % WEEK_MINUTES;
+}
+
+// Whether the calendar of the event behind tr blocked it on the day it fired,
+// given that it fired age minutes before t
+static bool transition_blocked(const LightScheduleTable *t, const ScheduleTransition *tr,
+                               Time now, int age) {
+    const ScheduledEvent *e = &t->events[tr->slot];
+    if(e->calendarMode == CALENDAR_NONE) return false;
+    int year = now.year, dayOfYear = now.dayOfYear;
+    if(year != 0 && age > now.minuteOfDay) {
+        dayOfYear -= (age - now.minuteOfDay + 24*60 - 1) / (24*60);
+        if(dayOfYear < 1) dayOfYear += days_in_year(--year);
+    }
+    bool listed = calendar_contains(e->calendar, year, dayOfYear);
+    return (e->calendarMode == CALENDAR_ONLY) ? !listed : listed;
+}
+
+// Last transition of light l at or before now, wrapping to the end of the
+// week when the light has not fired yet this week, and skipping removed or
+// calendar-blocked events. -1 if it never fires.
+static int last_transition(const LightScheduleTable *t, int l, Time now,
+                           const uint32_t *removed) {
+    int weekMinute = (now.dayOfWeek - MONDAY) * 24*60 + now.minuteOfDay;
+    int lo = t->transitionStart[l], hi = t->transitionStart[l + 1];
+    int first = lo, n = hi - lo;
+    if(n == 0) return -1;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(t->transitions[mid].weekMinute <= weekMinute) lo = mid + 1;
+        else hi = mid;
+    }
+    int i = lo - first - 1;
+    for(int k = 0; k < n; k++) {
+        int pos = first + (i - k + n) % n;
+        const ScheduleTransition *tr = &t->transitions[pos];
+        if(!bit_test(removed, tr->slot)
+           && !transition_blocked(t, tr, now, transition_age(tr, weekMinute))) return pos;
+    }
+    return -1;
+}
+
+// Recency of a firing: lower is more recent. Inside one minute the overlay
+// fires after the static table, runtime events by scheduling order and static
+// ones by id, so the later ones rank as more recent.
+static int64_t recency(const ScheduleTransition *tr, int weekMinute, bool overlay) {
+    int64_t tie = overlay ? (int64_t)events[tr->slot].order + (INT64_C(1) << 32) : tr->slot;
+    return ((int64_t)transition_age(tr, weekMinute) << 34) - tie;
+}
+
+// Effective state of every light at time t: O(lights * log events), plus the
+// group firings walked back from t, each group being expanded only once, from
+// its most recent firing, over the members not decided by a more recent group
+int LightScheduler_stateAt(Time t, StateBitmap *out) {
+    if(out == NULL || t.dayOfWeek < MONDAY || t.dayOfWeek > SUNDAY) return -1;
+    if(t.minuteOfDay < 0 || t.minuteOfDay > 23*60+59) return -1;
+    if(transitionsDirty) build_transitions();
+
+    LightScheduleTable overlay = overlay_view();
+    memset(out, 0, sizeof(*out));
+    int weekMinute = (t.dayOfWeek - MONDAY) * 24*60 + t.minuteOfDay;
+    int64_t best[256];
+    for(int l = 0; l < 256; l++) {
+        const ScheduleTransition *tr = NULL;
+        best[l] = (int64_t)WEEK_MINUTES << 34;
+        int i = last_transition(&overlay, l, t, NULL);
+        if(i >= 0) {
+            tr = &transitions[i];
+            best[l] = recency(tr, weekMinute, true);
+        }
+        if(staticTable != NULL) {
+            int s = last_transition(staticTable, l, t, staticRemoved);
+            if(s >= 0 && recency(&staticTable->transitions[s], weekMinute, false) < best[l]) {
+                tr = &staticTable->transitions[s];
+                best[l] = recency(tr, weekMinute, false);
+            }
+        }
+        if(tr == NULL) continue;
+        out->known[l >> 5] |= 1u << (l & 31);
+        if(tr->action == TURN_ON) out->on[l >> 5] |= 1u << (l & 31);
+    }
+
+    int n = groupTransitionCount, lo = 0, hi = n;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(groupTransitions[mid].weekMinute <= weekMinute) lo = mid + 1;
+        else hi = mid;
+    }
+    uint32_t resolved[8] = {0};     // Lights already decided by a more recent group firing
+    uint32_t expanded = 0;          // Groups whose most recent firing has been applied
+    uint32_t allGroups = (1u << groupCount) - 1;
+    for(int k = 1; k <= n && expanded != allGroups; k++) {
+        const ScheduleTransition *tr = &groupTransitions[(lo - k + n) % n];
+        int g = events[tr->slot].group - 1;
+        if((expanded >> g) & 1u) continue;  // Older firing, its lights are already decided
+        if(transition_blocked(&overlay, tr, t, transition_age(tr, weekMinute))) continue;
+        expanded |= 1u << g;
+        int64_t key = recency(tr, weekMinute, true);
+        for(int w = 0; w < 8; w++) {
+            uint32_t pending = groups[g].bits[w] & ~resolved[w];
+            resolved[w] |= groups[g].bits[w];
+            for(; pending != 0; pending &= pending - 1) {
+                int l = w * 32 + __builtin_ctz(pending);
+                if(key >= best[l]) continue;
+                out->known[w] |= 1u << (l & 31);
+                if(tr->action == TURN_ON) out->on[w] |= 1u << (l & 31);
+                else out->on[w] &= ~(1u << (l & 31));
+            }
+        }
+    }
+    return 0;
+}
+
+// Send to the driver only the lights whose actual state differs from the schedule
+int LightScheduler_reconcile(const StateBitmap *actual) {
+    Time timeNow;
+    StateBitmap expected;
+    TimeService_getTime(&timeNow);
+    if(LightScheduler_stateAt(timeNow, &expected) < 0) return -1;
+
+    int sent = 0;
+    for(int l = 0; l < 256; l++) {
+        if(!StateBitmap_isKnown(&expected, l)) continue;
+        bool on = StateBitmap_isOn(&expected, l);
+        if(actual != NULL && StateBitmap_isKnown(actual, l)
+           && StateBitmap_isOn(actual, l) == on) continue;
+        on ? driver->on(l) : driver->off(l);
+        sent++;
+    }
+    return sent;
 }
 
 // Immediate light control with validation
 int turn_on_led_now(int id){
     if (id < 0 || id > 255 ) return -1;  // Validate ID
-    LightControl_on(id);                 // Direct control
+    driver->on(id);                      // Direct control
     return 0;
 }
 
 int turn_off_led_now(int id){
     if (id < 0 || id > 255 ) return -1;  // Validate ID
-    LightControl_off(id);                // Direct control
+    driver->off(id);                     // Direct control
     return 0;
 }
 
 // Legacy flag check (currently always returns true)
 bool did_u_wake_me_up_one_minute_before(int id){
-    return events[id].one_minute_befores;  // Return preset flag value
+    if(is_static_handle(id)) {
+        int slot = id - LIGHT_SCHEDULER_STATIC_BASE;
+        return staticTable != NULL && slot < staticTable->eventCount && !bit_test(staticRemoved, slot)
+            && staticTable->events[slot].one_minute_befores;
+    }
+    int slot = slot_of(id);        // Invalid or stale handles have no event
+    return slot >= 0 && events[slot].one_minute_befores;  // Return preset flag value
 }
\ No newline at end of file
@@ -0,0 +1,697 @@
+#include "LightSchedulerCheck.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define CHECK_LIGHTS 12         // Light ids 0..11: enough for events to collide
+#define CHECK_GROUPS 2
+#define CHECK_CALENDARS 2
+#define CHECK_DATES 6
+#define CHECK_DAYS 15           // One week to fill the history, then stateAt is compared
+#define CHECK_EXTRA_TICKS 4     // Random minutes, ticked as well
+#define CHECK_MAX_COMMANDS 1024
+#define CHECK_MAX_TICKS (3 * LIGHT_CHECK_MAX_OPS + CHECK_EXTRA_TICKS)
+#define REF_EVENTS (2 * LIGHT_SCHEDULER_STATIC_BASE)
+
+// A generated case: ops are what the minimizer shrinks, the rest is fixed by seed
+typedef struct {
+    unsigned seed;
+    int opCount;
+    LightCheckOp ops[LIGHT_CHECK_MAX_OPS];
+    int applyFrom;                  // First op folded into LightScheduler_apply
+    LightSet groups[CHECK_GROUPS];
+    int dates[CHECK_CALENDARS][CHECK_DATES][3];     // year, month, day
+    int startYear, startDayOfYear;
+    WeekDay startDay;
+    int extraTicks[CHECK_EXTRA_TICKS];
+} CheckCase;
+
+// Reference event: a slot of the table the original wakeup scanned in order
+typedef struct {
+    bool active;
+    ScheduleEntry entry;
+    int handle;             // Returned by the scheduler for this event
+    int generation;         // Runtime slots: generation of the next handle of the slot
+    long order;             // Scheduling order, which is the order of the per-light lists
+} RefEvent;
+
+typedef struct {
+    int lightId;
+    Action action;
+} Command;
+
+// ref[slot] for runtime slots, ref[LIGHT_SCHEDULER_STATIC_BASE + i] for the
+// static table; the static events come first inside a minute
+static RefEvent ref[REF_EVENTS];
+static long refOrder;
+static Command captured[CHECK_MAX_COMMANDS];
+static int capturedCount;
+
+// Static table of the current case, laid out like tools/generate_schedule.rb output
+static ScheduledEvent tableEvents[256];
+static int tableLightHead[256];
+static int tableDayIndex[7 * 256];
+static ScheduleTransition tableTransitions[7 * 256];
+static int tableTransitionStart[257];
+static LightScheduleTable table;
+
+static unsigned next_random(unsigned *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static int random_below(unsigned *state, int n) {
+    return (int)(next_random(state) % (unsigned)n);
+}
+
+// Driver standing in for LightControl: group commands are expanded per light
+static void capture(int id, Action action) {
+    if(capturedCount < CHECK_MAX_COMMANDS) captured[capturedCount] = (Command){ id, action };
+    capturedCount++;
+}
+static void capture_on(int id) { capture(id, TURN_ON); }
+static void capture_off(int id) { capture(id, TURN_OFF); }
+static void capture_many(const LightSet *lights, Action action) {
+    for(int l = 0; l < 256; l++)
+        if((lights->bits[l >> 5] >> (l & 31)) & 1u) capture(l, action);
+}
+static void capture_on_many(const LightSet *lights) { capture_many(lights, TURN_ON); }
+static void capture_off_many(const LightSet *lights) { capture_many(lights, TURN_OFF); }
+
+static const LightDriver captureDriver = {
+    capture_on, capture_off, capture_on_many, capture_off_many
+};
+
+// Reference semantics, kept independent from the optimized code paths
+
+static bool ref_matches_day(WeekDay scheduled, WeekDay current) {
+    if(scheduled == EVERYDAY) return true;
+    if(scheduled == WEEKDAY) return current >= MONDAY && current <= FRIDAY;
+    if(scheduled == WEEKEND) return current == SATURDAY || current == SUNDAY;
+    return scheduled == current;
+}
+
+static bool ref_leap(int year) {
+    return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+}
+
+static int ref_month_days(int year, int month) {
+    static const int days[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    return days[month - 1] + ((month == 2 && ref_leap(year)) ? 1 : 0);
+}
+
+static bool ref_listed(const CheckCase *c, int calendar, int year, int dayOfYear) {
+    int month = 1;
+    while(dayOfYear > ref_month_days(year, month)) dayOfYear -= ref_month_days(year, month++);
+    for(int i = 0; i < CHECK_DATES; i++) {
+        const int *d = c->dates[calendar - 1][i];
+        if(d[0] == year && d[1] == month && d[2] == dayOfYear) return true;
+    }
+    return false;
+}
+
+static bool ref_fires(const CheckCase *c, const RefEvent *e, Time now) {
+    const ScheduleEntry *s = &e->entry;
+    if(!e->active || s->minute != now.minuteOfDay || !ref_matches_day(s->day, now.dayOfWeek))
+        return false;
+    if(s->calendarMode == CALENDAR_NONE) return true;
+    bool listed = ref_listed(c, s->calendar, now.year, now.dayOfYear);
+    return (s->calendarMode == CALENDAR_ONLY) ? listed : !listed;
+}
+
+// k-th reference slot: the static table first, then the runtime slots
+static int ref_at(int k) {
+    return (k + LIGHT_SCHEDULER_STATIC_BASE) % REF_EVENTS;
+}
+
+// Reference event a handle refers to, -1 if it is not live
+static int ref_find(int h) {
+    if(h >= LIGHT_SCHEDULER_STATIC_BASE && h < REF_EVENTS) return ref[h].active ? h : -1;
+    if(h < 0 || (h & LIGHT_SCHEDULER_STATIC_BASE)) return -1;
+    int slot = h & (LIGHT_SCHEDULER_STATIC_BASE - 1);
+    return (ref[slot].active && ref[slot].handle == h) ? slot : -1;
+}
+
+static void ref_remove(int id) {
+    ref[id].active = false;
+    if(id < LIGHT_SCHEDULER_STATIC_BASE) ref[id].generation++;
+}
+
+// Records a runtime event under the handle the scheduler returned: it must
+// name a free slot with the generation that follows the slot's last event
+static bool ref_add(int h, const ScheduleEntry *entry) {
+    if(h < 0 || (h & LIGHT_SCHEDULER_STATIC_BASE)) return false;
+    RefEvent *e = &ref[h & (LIGHT_SCHEDULER_STATIC_BASE - 1)];
+    if(e - ref >= LIGHT_SCHEDULER_MAX_EVENTS || e->active
+       || h >> LIGHT_SCHEDULER_GENERATION_SHIFT != e->generation) return false;
+    e->active = true;
+    e->entry = *entry;
+    e->handle = h;
+    e->order = refOrder++;
+    return true;
+}
+
+// Collects the live reference events in firing order, returns their number
+static int ref_live(int *live) {
+    int n = 0;
+    for(int k = 0; k < REF_EVENTS; k++) {
+        int id = ref_at(k);
+        if(!ref[id].active) continue;
+        // Runtime events fire in scheduling order, whatever slot they reuse
+        int pos = n++;
+        while(pos > 0 && id < LIGHT_SCHEDULER_STATIC_BASE && live[pos - 1] < LIGHT_SCHEDULER_STATIC_BASE
+              && ref[live[pos - 1]].order > ref[id].order) {
+            live[pos] = live[pos - 1];
+            pos--;
+        }
+        live[pos] = id;
+    }
+    return n;
+}
+
+static int ref_live_runtime(void) {
+    int live = 0;
+    for(int id = 0; id < LIGHT_SCHEDULER_MAX_EVENTS; id++) live += ref[id].active;
+    return live;
+}
+
+static const WeekDay dayChoices[] = {
+    MONDAY, TUESDAY, WEDNESDAY, THURDSDAY, FRIDAY, SATURDAY, SUNDAY,
+    EVERYDAY, EVERYDAY, WEEKDAY, WEEKEND
+};
+
+// Cases alternate between runtime events only, a static table with a
+// runtime overlay, and both followed by one LightScheduler_apply
+static void generate_case(unsigned seed, CheckCase *c) {
+    unsigned r = seed * 2654435761u + 1;
+    int mode = random_below(&r, 4);
+    memset(c, 0, sizeof(*c));
+    c->seed = seed;
+    c->startYear = 2023 + random_below(&r, 3);
+    c->startDayOfYear = 1 + random_below(&r, 365);
+    c->startDay = (WeekDay)(MONDAY + random_below(&r, 7));
+    for(int g = 0; g < CHECK_GROUPS; g++)
+        for(int l = 0; l < CHECK_LIGHTS; l++)
+            if(random_below(&r, 3) == 0) c->groups[g].bits[0] |= 1u << l;
+    c->groups[0].bits[0] |= 1u << random_below(&r, CHECK_LIGHTS);
+    c->groups[1].bits[7] |= 1u << random_below(&r, 32);     // A light outside the event lights
+    // Dates around the simulated weeks, including the turn of the year
+    for(int k = 0; k < CHECK_CALENDARS; k++) {
+        for(int i = 0; i < CHECK_DATES; i++) {
+            int year = c->startYear, dayOfYear = c->startDayOfYear + random_below(&r, CHECK_DAYS + 2) - 1;
+            int length = ref_leap(year) ? 366 : 365;
+            if(dayOfYear > length) { dayOfYear -= length; year++; }
+            if(dayOfYear < 1) dayOfYear = 1;
+            int month = 1;
+            while(dayOfYear > ref_month_days(year, month)) dayOfYear -= ref_month_days(year, month++);
+            c->dates[k][i][0] = year;
+            c->dates[k][i][1] = month;
+            c->dates[k][i][2] = dayOfYear;
+        }
+    }
+    // Few distinct minutes, so that events share their minute
+    int minutes[6];
+    for(int i = 0; i < 6; i++) minutes[i] = random_below(&r, 24*60);
+    for(int i = 0; i < CHECK_EXTRA_TICKS; i++) c->extraTicks[i] = random_below(&r, 24*60);
+
+    c->opCount = 8 + random_below(&r, LIGHT_CHECK_MAX_OPS - 8 + 1);
+    for(int i = 0; i < c->opCount; i++) {
+        LightCheckOp *op = &c->ops[i];
+        int kind = random_below(&r, 10);
+        op->day = dayChoices[random_below(&r, sizeof(dayChoices) / sizeof(dayChoices[0]))];
+        op->minute = minutes[random_below(&r, 6)];
+        op->action = (Action)random_below(&r, 2);
+        if(i > 0 && kind == 0) {
+            op->kind = CHECK_REMOVE;
+            op->target = random_below(&r, i);
+        } else if(i > 0 && kind <= 2) {
+            op->kind = CHECK_SET_CALENDAR;
+            op->target = random_below(&r, i);
+            op->calendar = 1 + random_below(&r, CHECK_CALENDARS);
+            op->mode = (CalendarMode)random_below(&r, 3);
+        } else if(kind <= 4) {
+            op->kind = CHECK_SCHEDULE_GROUP;
+            op->target = 1 + random_below(&r, CHECK_GROUPS);
+        } else {
+            op->kind = CHECK_SCHEDULE;
+            op->target = random_below(&r, CHECK_LIGHTS);
+            op->inStaticTable = (mode & 1) && random_below(&r, 2) == 0;
+        }
+    }
+    c->applyFrom = (mode & 2) ? 1 + random_below(&r, c->opCount - 1) : c->opCount;
+}
+
+static int compare_ints(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+static bool ref_for_light(const RefEvent *e, const CheckCase *c, int l) {
+    if(!e->active) return false;
+    if(e->entry.group == 0) return e->entry.lightId == l;
+    return (c->groups[e->entry.group - 1].bits[l >> 5] >> (l & 31)) & 1u;
+}
+
+// Compares the query functions with a scan of the reference table
+static bool check_queries(const CheckCase *c, char *what, size_t size) {
+    int got[REF_EVENTS], want[REF_EVENTS], live[REF_EVENTS];
+    int liveCount = ref_live(live);
+    for(int l = 0; l < 256; l++) {
+        int n = LightScheduler_eventsForLight(l, got, REF_EVENTS), m = 0;
+        for(int j = 0; j < liveCount; j++)
+            if(ref_for_light(&ref[live[j]], c, l)) want[m++] = ref[live[j]].handle;
+        if(n >= 0) qsort(got, n, sizeof(int), compare_ints);
+        qsort(want, m, sizeof(int), compare_ints);
+        if(n != m || memcmp(got, want, m * sizeof(int)) != 0) {
+            snprintf(what, size, "eventsForLight(%d): %d events, reference %d", l, n, m);
+            return false;
+        }
+    }
+    for(WeekDay day = MONDAY; day <= SUNDAY; day++) {
+        int from = 0, to = 23*60+59;
+        for(int pass = 0; pass < 2; pass++) {
+            int n = LightScheduler_eventsInRange(day, from, to, got, REF_EVENTS), m = 0;
+            int minuteOf[REF_EVENTS];
+            for(int j = 0; j < liveCount; j++) {
+                const RefEvent *e = &ref[live[j]];
+                int minute = e->entry.minute;
+                if(minute < from || minute > to || !ref_matches_day(e->entry.day, day)) continue;
+                int pos = m++;      // Insert by minute, after the events firing before it in that minute
+                for(; pos > 0 && minuteOf[pos - 1] > minute; pos--) {
+                    want[pos] = want[pos - 1];
+                    minuteOf[pos] = minuteOf[pos - 1];
+                }
+                want[pos] = e->handle;
+                minuteOf[pos] = minute;
+            }
+            if(n != m || memcmp(got, want, m * sizeof(int)) != 0) {
+                snprintf(what, size, "eventsInRange(day %d, %d, %d): %d events, reference %d",
+                         (int)day, from, to, n, m);
+                return false;
+            }
+            from = 6*60; to = 18*60;
+        }
+    }
+    return true;
+}
+
+static ScheduleEntry entry_of_op(const LightCheckOp *op) {
+    return (ScheduleEntry){
+        .lightId = (op->kind == CHECK_SCHEDULE) ? op->target : 0,
+        .group = (op->kind == CHECK_SCHEDULE_GROUP) ? op->target : 0,
+        .day = op->day, .minute = op->minute, .action = op->action
+    };
+}
+
+// Lays the static ops out as tools/generate_schedule.rb does (stable sort by
+// minute, per-light lists, day rows, per-light transitions) and records them
+// in the reference. Returns the number of static events.
+static int build_table(const CheckCase *c, int *handles) {
+    int slots[LIGHT_CHECK_MAX_OPS], count = 0;
+    for(int i = 0; i < c->opCount; i++) {
+        if(!c->ops[i].inStaticTable) continue;
+        int pos = count++;
+        for(; pos > 0 && c->ops[slots[pos - 1]].minute > c->ops[i].minute; pos--) slots[pos] = slots[pos - 1];
+        slots[pos] = i;
+    }
+    int tail[256];
+    for(int l = 0; l < 256; l++) tableLightHead[l] = tail[l] = -1;
+    for(int s = 0; s < count; s++) {
+        const LightCheckOp *op = &c->ops[slots[s]];
+        tableEvents[s] = (ScheduledEvent){
+            .id = s, .lightId = op->target, .day = op->day, .minute = op->minute,
+            .action = op->action, .active = true, .one_minute_befores = true,
+            .nextForLight = -1, .prevForLight = tail[op->target]
+        };
+        if(tail[op->target] >= 0) tableEvents[tail[op->target]].nextForLight = s;
+        else tableLightHead[op->target] = s;
+        tail[op->target] = s;
+        handles[slots[s]] = LIGHT_SCHEDULER_STATIC_BASE + s;
+        ref[LIGHT_SCHEDULER_STATIC_BASE + s] = (RefEvent){
+            .active = true, .entry = entry_of_op(op), .handle = LIGHT_SCHEDULER_STATIC_BASE + s
+        };
+    }
+
+    int used = 0, perLight[257] = {0};
+    for(int row = 0; row < 7; row++) {
+        table.dayIndex[row] = tableDayIndex + used;
+        table.dayCount[row] = 0;
+        for(int s = 0; s < count; s++) {
+            if(!ref_matches_day(tableEvents[s].day, (WeekDay)(MONDAY + row))) continue;
+            tableDayIndex[used++] = s;
+            table.dayCount[row]++;
+            perLight[tableEvents[s].lightId + 1]++;
+        }
+    }
+    tableTransitionStart[0] = 0;
+    for(int l = 0; l < 256; l++) tableTransitionStart[l + 1] = tableTransitionStart[l] + perLight[l + 1];
+    int fill[256];
+    memcpy(fill, tableTransitionStart, sizeof(fill));
+    for(int row = 0; row < 7; row++) {
+        for(int k = 0; k < table.dayCount[row]; k++) {
+            const ScheduledEvent *e = &tableEvents[table.dayIndex[row][k]];
+            tableTransitions[fill[e->lightId]++] = (ScheduleTransition){
+                .weekMinute = (int16_t)(row * 24*60 + e->minute),
+                .slot = (uint8_t)e->id,
+                .action = (uint8_t)e->action
+            };
+        }
+    }
+    table.events = tableEvents;
+    table.eventCount = count;
+    table.lightHead = tableLightHead;
+    table.transitions = tableTransitions;
+    table.transitionStart = tableTransitionStart;
+    return count;
+}
+
+// Applies op i to the scheduler and to the reference
+static bool apply_op(const CheckCase *c, int i, int *handles, char *what, size_t size) {
+    const LightCheckOp *op = &c->ops[i];
+    if(op->inStaticTable) return true;      // Loaded with the table
+    ScheduleEntry entry = entry_of_op(op);
+    int h, id;
+    handles[i] = -1;
+    switch(op->kind) {
+    case CHECK_SCHEDULE:
+    case CHECK_SCHEDULE_GROUP:
+        h = (op->kind == CHECK_SCHEDULE)
+            ? LightScheduler_schedule(op->target, op->day, op->minute, op->action)
+            : LightScheduler_scheduleGroup(op->target, op->day, op->minute, op->action);
+        if(h == -1 && ref_live_runtime() == LIGHT_SCHEDULER_MAX_EVENTS) break;    // Full
+        if(!ref_add(h, &entry)) {
+            snprintf(what, size, "op %d: scheduling returned handle %d", i, h);
+            return false;
+        }
+        handles[i] = h;
+        break;
+    case CHECK_REMOVE:
+        if(op->target < 0) break;
+        id = ref_find(handles[op->target]);
+        if(LightScheduler_remove(handles[op->target]) != (id >= 0 ? 0 : -1)) {
+            snprintf(what, size, "op %d: remove(%d) disagrees on validity", i, handles[op->target]);
+            return false;
+        }
+        if(id >= 0) ref_remove(id);
+        break;
+    case CHECK_SET_CALENDAR:
+        if(op->target < 0) break;
+        h = handles[op->target];
+        id = ref_find(h);
+        if(id >= LIGHT_SCHEDULER_STATIC_BASE) id = -1;     // Static events keep their calendar
+        if(LightScheduler_setEventCalendar(h, op->calendar, op->mode) != (id >= 0 ? 0 : -1)) {
+            snprintf(what, size, "op %d: setEventCalendar(%d) disagrees on validity", i, h);
+            return false;
+        }
+        if(id >= 0) {
+            ref[id].entry.calendar = op->calendar;
+            ref[id].entry.calendarMode = op->mode;
+        }
+        break;
+    }
+    return true;
+}
+
+static bool same_entry(const ScheduleEntry *a, const ScheduleEntry *b) {
+    if(a->group != b->group || (a->group == 0 && a->lightId != b->lightId)) return false;
+    if(a->day != b->day || a->minute != b->minute || a->action != b->action) return false;
+    if(a->calendarMode != b->calendarMode) return false;
+    return a->calendarMode == CALENDAR_NONE || a->calendar == b->calendar;
+}
+
+// Live event that LightScheduler_apply keeps for entry: an equal static event
+// first (lowest slot), else the equal runtime event scheduled first
+static int ref_match(const ScheduleEntry *entry, const bool *kept) {
+    int best = -1;
+    for(int k = 0; k < REF_EVENTS; k++) {
+        int id = ref_at(k);
+        if(!ref[id].active || kept[id] || !same_entry(&ref[id].entry, entry)) continue;
+        if(id >= LIGHT_SCHEDULER_STATIC_BASE) return id;
+        if(best < 0 || ref[id].order < ref[best].order) best = id;
+    }
+    return best;
+}
+
+// Entry of the target of an op folded into the applied schedule, -1 if none
+static int entry_of_target(const CheckCase *c, int target, const int *handles,
+                           const int *opEntry, const int *source, int n) {
+    if(target < 0) return -1;
+    if(target >= c->applyFrom && opEntry[target] >= 0) return opEntry[target];
+    int id = ref_find(handles[target]);
+    for(int k = 0; id >= 0 && k < n; k++) if(source[k] == id) return k;
+    return -1;
+}
+
+// Folds ops[applyFrom..] into the schedule live at that point (some of its
+// events being dropped), installs it with LightScheduler_apply and checks the
+// result against the matching done on the reference
+static bool apply_rest(const CheckCase *c, int *handles, char *what, size_t size) {
+    static ScheduleEntry entries[REF_EVENTS + LIGHT_CHECK_MAX_OPS];
+    static ScheduleEntry applied[REF_EVENTS + LIGHT_CHECK_MAX_OPS];
+    int source[REF_EVENTS + LIGHT_CHECK_MAX_OPS];  // Reference event an entry keeps, -1 for new ones
+    bool dropped[REF_EVENTS + LIGHT_CHECK_MAX_OPS] = {false};
+    int opEntry[LIGHT_CHECK_MAX_OPS];
+    int n = 0;
+    int live[REF_EVENTS], liveCount = ref_live(live);
+    unsigned r = c->seed * 40503u + 7;
+    for(int k = 0; k < liveCount; k++) {
+        int id = live[k];
+        if(random_below(&r, 4) == 0) continue;      // Left out: removed by apply
+        source[n] = id;
+        entries[n++] = ref[id].entry;
+    }
+    for(int i = c->applyFrom; i < c->opCount; i++) {
+        const LightCheckOp *op = &c->ops[i];
+        opEntry[i] = -1;
+        if(op->inStaticTable) continue;
+        int t = entry_of_target(c, op->target, handles, opEntry, source, n);
+        switch(op->kind) {
+        case CHECK_SCHEDULE:
+        case CHECK_SCHEDULE_GROUP:
+            opEntry[i] = n;
+            source[n] = -1;
+            entries[n++] = entry_of_op(op);
+            break;
+        case CHECK_REMOVE:
+            if(t >= 0) dropped[t] = true;
+            break;
+        case CHECK_SET_CALENDAR:
+            if(t < 0) break;
+            entries[t].calendar = op->calendar;
+            entries[t].calendarMode = op->mode;
+            break;
+        }
+    }
+
+    bool kept[REF_EVENTS] = {false};
+    int match[REF_EVENTS + LIGHT_CHECK_MAX_OPS];
+    int count = 0, added = 0, keptRuntime = 0, removed = 0;
+    for(int k = 0; k < n; k++) {
+        if(dropped[k]) continue;
+        applied[count] = entries[k];
+        match[count] = ref_match(&applied[count], kept);
+        if(match[count] < 0) added++;
+        else {
+            kept[match[count]] = true;
+            keptRuntime += match[count] < LIGHT_SCHEDULER_STATIC_BASE;
+        }
+        count++;
+    }
+    for(int id = 0; id < REF_EVENTS; id++) removed += ref[id].active && !kept[id];
+    int expected = (added > LIGHT_SCHEDULER_MAX_EVENTS - keptRuntime) ? -1 : added + removed;
+    int got[REF_EVENTS + LIGHT_CHECK_MAX_OPS];
+    int rc = LightScheduler_apply(applied, count, got);
+    if(rc != expected) {
+        snprintf(what, size, "apply of %d entries returned %d, reference %d", count, rc, expected);
+        return false;
+    }
+    if(rc < 0) return true;     // Nothing changed
+
+    for(int id = 0; id < REF_EVENTS; id++) {
+        if(ref[id].active && !kept[id]) ref_remove(id);
+    }
+    for(int k = 0; k < count; k++) {
+        if(match[k] >= 0 ? got[k] == ref[match[k]].handle : ref_add(got[k], &applied[k])) continue;
+        snprintf(what, size, "apply entry %d got handle %d, reference %d", k, got[k],
+                 match[k] >= 0 ? ref[match[k]].handle : -1);
+        return false;
+    }
+    return true;
+}
+
+// Replays a case on both sides. Returns true if they agree everywhere,
+// otherwise describes the first difference in what.
+static bool run_case(const CheckCase *c, long *ticks, char *what, size_t size) {
+    int handles[LIGHT_CHECK_MAX_OPS];
+    memset(ref, 0, sizeof(ref));
+    refOrder = 0;
+    for(int i = 0; i < c->opCount; i++) handles[i] = -1;
+    if(build_table(c, handles) > 0) LightScheduler_loadStatic(&table);
+    else LightScheduler_clear();
+    for(int g = 0; g < CHECK_GROUPS; g++) {
+        int members[256], n = 0;
+        for(int l = 0; l < 256; l++)
+            if((c->groups[g].bits[l >> 5] >> (l & 31)) & 1u) members[n++] = l;
+        if(LightScheduler_defineGroup(members, n) != g + 1) {
+            snprintf(what, size, "defineGroup did not return %d", g + 1);
+            return false;
+        }
+    }
+    for(int k = 0; k < CHECK_CALENDARS; k++) {
+        char name[16];
+        snprintf(name, sizeof(name), "check-%d", k + 1);
+        LightScheduler_defineCalendar(name);
+        for(int i = 0; i < CHECK_DATES; i++)
+            LightScheduler_calendarAddDate(k + 1, c->dates[k][i][0], c->dates[k][i][1], c->dates[k][i][2]);
+    }
+    for(int i = 0; i < c->applyFrom; i++)
+        if(!apply_op(c, i, handles, what, size)) return false;
+    if(c->applyFrom < c->opCount && !apply_rest(c, handles, what, size)) return false;
+    if(!check_queries(c, what, size)) return false;
+
+    // Every minute an event can fire at and the minutes around it, plus a few
+    // random ones, in order
+    int tickMinutes[CHECK_MAX_TICKS], tickCount = 0;
+    for(int i = 0; i < c->opCount; i++) {
+        if(c->ops[i].kind != CHECK_SCHEDULE && c->ops[i].kind != CHECK_SCHEDULE_GROUP) continue;
+        for(int m = c->ops[i].minute - 1; m <= c->ops[i].minute + 1; m++)
+            if(m >= 0 && m < 24*60) tickMinutes[tickCount++] = m;
+    }
+    for(int i = 0; i < CHECK_EXTRA_TICKS; i++) tickMinutes[tickCount++] = c->extraTicks[i];
+    qsort(tickMinutes, tickCount, sizeof(int), compare_ints);
+
+    // The reference table no longer changes: scan only its live events
+    int live[REF_EVENTS], liveCount = ref_live(live);
+
+    int state[256], lastFired[256];     // Reference light state, and when it was last set
+    for(int l = 0; l < 256; l++) lastFired[l] = -1;
+    Time now = { c->startDay, 0, c->startYear, c->startDayOfYear };
+    for(int d = 0; d < CHECK_DAYS; d++) {
+        for(int k = 0; k < tickCount; k++) {
+            if(k > 0 && tickMinutes[k] == tickMinutes[k - 1]) continue;
+            now.minuteOfDay = tickMinutes[k];
+            int clock = d * 24*60 + now.minuteOfDay;
+            Command expected[CHECK_MAX_COMMANDS];
+            int expectedCount = 0;
+            for(int j = 0; j < liveCount; j++) {
+                const RefEvent *e = &ref[live[j]];
+                if(!ref_fires(c, e, now)) continue;
+                int first = e->entry.group ? 0 : e->entry.lightId, last = e->entry.group ? 255 : first;
+                for(int l = first; l <= last; l++) {
+                    if(!ref_for_light(e, c, l)) continue;
+                    if(expectedCount < CHECK_MAX_COMMANDS) expected[expectedCount++] = (Command){ l, e->entry.action };
+                    state[l] = e->entry.action;
+                    lastFired[l] = clock;
+                }
+            }
+            capturedCount = 0;
+            LightScheduler_wakeupAt(now);
+            (*ticks)++;
+            for(int i = 0; i < expectedCount || i < capturedCount; i++) {
+                if(i < expectedCount && i < capturedCount
+                   && expected[i].lightId == captured[i].lightId && expected[i].action == captured[i].action)
+                    continue;
+                snprintf(what, size, "day %d (%d-%03d, weekday %d) %02d:%02d: command #%d is light %d %s, reference light %d %s",
+                         d, now.year, now.dayOfYear, (int)now.dayOfWeek,
+                         now.minuteOfDay / 60, now.minuteOfDay % 60, i,
+                         i < capturedCount ? captured[i].lightId : -1,
+                         i < capturedCount ? (captured[i].action == TURN_ON ? "on" : "off") : "missing",
+                         i < expectedCount ? expected[i].lightId : -1,
+                         i < expectedCount ? (expected[i].action == TURN_ON ? "on" : "off") : "missing");
+                return false;
+            }
+            if(d < 7) continue;
+
+            // A firing older than a week is replaced by the same weekly event
+            StateBitmap s;
+            LightScheduler_stateAt(now, &s);
+            for(int l = 0; l < 256; l++) {
+                bool known = lastFired[l] >= 0 && clock - lastFired[l] < 7 * 24*60;
+                if(StateBitmap_isKnown(&s, l) == known
+                   && (!known || StateBitmap_isOn(&s, l) == (state[l] == TURN_ON))) continue;
+                snprintf(what, size, "day %d (%d-%03d, weekday %d) %02d:%02d: stateAt light %d is %s, reference %s",
+                         d, now.year, now.dayOfYear, (int)now.dayOfWeek,
+                         now.minuteOfDay / 60, now.minuteOfDay % 60, l,
+                         !StateBitmap_isKnown(&s, l) ? "unknown" : StateBitmap_isOn(&s, l) ? "on" : "off",
+                         !known ? "unknown" : state[l] == TURN_ON ? "on" : "off");
+                return false;
+            }
+        }
+        now.dayOfWeek = (now.dayOfWeek == SUNDAY) ? MONDAY : (WeekDay)(now.dayOfWeek + 1);
+        if(++now.dayOfYear > (ref_leap(now.year) ? 366 : 365)) {
+            now.year++;
+            now.dayOfYear = 1;
+        }
+    }
+    return true;
+}
+
+// Removes op i; ops referring to it lose their target
+static void drop_op(CheckCase *c, int i) {
+    memmove(&c->ops[i], &c->ops[i + 1], (c->opCount - i - 1) * sizeof(LightCheckOp));
+    c->opCount--;
+    if(i < c->applyFrom) c->applyFrom--;
+    for(int k = i; k < c->opCount; k++) {
+        LightCheckOp *op = &c->ops[k];
+        if(op->kind != CHECK_REMOVE && op->kind != CHECK_SET_CALENDAR) continue;
+        if(op->target == i) op->target = -1;
+        else if(op->target > i) op->target--;
+    }
+}
+
+// Greedily drops ops for as long as the case still diverges
+static void minimize(CheckCase *c, char *what, size_t size) {
+    long ticks = 0;
+    bool shrunk = true;
+    while(shrunk) {
+        shrunk = false;
+        for(int i = c->opCount - 1; i >= 0; i--) {
+            CheckCase smaller = *c;
+            char text[sizeof(((LightCheckReport *)0)->divergence)];
+            drop_op(&smaller, i);
+            if(run_case(&smaller, &ticks, text, sizeof(text))) continue;
+            *c = smaller;
+            snprintf(what, size, "%s", text);
+            shrunk = true;
+        }
+    }
+}
+
+int LightSchedulerCheck_run(unsigned seed, long cases, LightCheckReport *report) {
+    static CheckCase c;
+    memset(report, 0, sizeof(*report));
+    LightScheduler_setDriver(&captureDriver);
+    for(long n = 0; n < cases && !report->diverged; n++) {
+        generate_case(seed + (unsigned)n, &c);
+        report->cases++;
+        if(run_case(&c, &report->ticks, report->divergence, sizeof(report->divergence))) continue;
+        minimize(&c, report->divergence, sizeof(report->divergence));
+        report->diverged = true;
+        report->caseSeed = c.seed;
+        report->opCount = c.opCount;
+        report->applyFrom = c.applyFrom;
+        memcpy(report->ops, c.ops, c.opCount * sizeof(LightCheckOp));
+    }
+    LightScheduler_setDriver(NULL);
+    LightScheduler_clear();
+    return report->diverged ? 1 : 0;
+}
+
+void LightSchedulerCheck_print(const LightCheckReport *report, FILE *out) {
+    static const char *kinds[] = { "schedule", "scheduleGroup", "remove", "setEventCalendar" };
+    fprintf(out, "%ld cases, %ld ticks: %s\n", report->cases, report->ticks,
+            report->diverged ? "DIVERGED" : "no divergence");
+    if(!report->diverged) return;
+    fprintf(out, "case seed %u: %s\n", report->caseSeed, report->divergence);
+    for(int i = 0; i < report->opCount; i++) {
+        const LightCheckOp *op = &report->ops[i];
+        if(i == report->applyFrom) fprintf(out, "  -- the ops below go through one apply\n");
+        fprintf(out, "  %2d %s%s(%d", i, op->inStaticTable ? "static " : "", kinds[op->kind], op->target);
+        if(op->kind == CHECK_SCHEDULE || op->kind == CHECK_SCHEDULE_GROUP)
+            fprintf(out, ", day %d, %02d:%02d, %s", (int)op->day, op->minute / 60, op->minute % 60,
+                    op->action == TURN_ON ? "on" : "off");
+        if(op->kind == CHECK_SET_CALENDAR)
+            fprintf(out, ", calendar %d, mode %d", op->calendar, (int)op->mode);
+        fprintf(out, ")\n");
+    }
+}
@@ -0,0 +1,276 @@
+#define _POSIX_C_SOURCE 200809L
+#include "LightSchedulerServer.h"
+#include "LightScheduler.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Largest response: header plus one id per event of a static table and the overlay
+#define MAX_RESULTS 512
+#define MAX_RESPONSE_SIZE (LSS_RESPONSE_HEADER_SIZE + MAX_RESULTS * 4)
+
+typedef struct {
+    int fd;                         // -1 when the slot is free
+    uint8_t in[64 * LSS_REQUEST_SIZE];
+    int inLen;
+    uint8_t out[4 * MAX_RESPONSE_SIZE];
+    int outLen;
+    bool closing;                   // The client shut down its side: no more requests
+} Client;
+
+static int listenFd = -1;
+static char socketPath[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static Client clients[LSS_MAX_CLIENTS];
+static int nextClient;              // Client served first by the next poll
+
+static int16_t get16(const uint8_t *p) {
+    int16_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static int32_t get32(const uint8_t *p) {
+    int32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+static void put32(uint8_t *p, int32_t v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return (flags < 0) ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Remove the socket left at addr by a daemon that crashed. A socket that still
+// accepts connections belongs to a running daemon and any other file is not
+// ours: both are left alone and make open fail.
+static int remove_stale_socket(const struct sockaddr_un *addr) {
+    struct stat st;
+    if(lstat(addr->sun_path, &st) < 0) return (errno == ENOENT) ? 0 : -1;
+    if(!S_ISSOCK(st.st_mode)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || set_nonblocking(fd) < 0) {
+        if(fd >= 0) close(fd);
+        return -1;
+    }
+    bool stale = connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0 && errno == ECONNREFUSED;
+    close(fd);
+    return stale ? unlink(addr->sun_path) : -1;
+}
+
+int LightSchedulerServer_open(const char *path) {
+    struct sockaddr_un addr;
+    if(path == NULL || strlen(path) >= sizeof(addr.sun_path) || listenFd >= 0) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if(remove_stale_socket(&addr) < 0) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, LSS_MAX_CLIENTS) < 0
+       || set_nonblocking(fd) < 0) {
+        close(fd);
+        return -1;
+    }
+    for(int i = 0; i < LSS_MAX_CLIENTS; i++) clients[i].fd = -1;
+    strcpy(socketPath, path);
+    listenFd = fd;
+    return 0;
+}
+
+void LightSchedulerServer_close(void) {
+    if(listenFd < 0) return;
+    for(int i = 0; i < LSS_MAX_CLIENTS; i++) {
+        if(clients[i].fd >= 0) close(clients[i].fd);
+        clients[i].fd = -1;
+    }
+    close(listenFd);
+    unlink(socketPath);
+    listenFd = -1;
+}
+
+static void drop_client(Client *c) {
+    close(c->fd);
+    c->fd = -1;
+}
+
+static void accept_clients(void) {
+    for(;;) {
+        int fd = accept(listenFd, NULL, NULL);
+        if(fd < 0) return;
+        Client *c = NULL;
+        for(int i = 0; i < LSS_MAX_CLIENTS && c == NULL; i++) {
+            if(clients[i].fd < 0) c = &clients[i];
+        }
+        if(c == NULL || set_nonblocking(fd) < 0) {
+            close(fd);  // Full: the tool sees the connection closed
+            continue;
+        }
+        c->fd = fd;
+        c->inLen = 0;
+        c->outLen = 0;
+        c->closing = false;
+    }
+}
+
+// Execute one request and append its response to out, returns the response size
+static int handle_request(const uint8_t *req, uint8_t *out) {
+    uint8_t op = req[0];
+    int action = req[1];
+    int lightId = (uint16_t)get16(req + 2);
+    WeekDay day = (WeekDay)get16(req + 4);
+    int minute = get16(req + 6);
+    int32_t arg = get32(req + 8);
+    int32_t value = 0;
+    int count = 0;
+    int ids[MAX_RESULTS];
+
+    switch(op) {
+    case LSS_OP_SCHEDULE:
+        value = (action == TURN_ON || action == TURN_OFF)
+              ? LightScheduler_schedule(lightId, day, minute, action) : -1;
+        break;
+    case LSS_OP_REMOVE:
+        value = LightScheduler_remove(arg);
+        break;
+    case LSS_OP_QUERY_LIGHT:
+        value = count = LightScheduler_eventsForLight(lightId, ids, MAX_RESULTS);
+        break;
+    case LSS_OP_QUERY_RANGE:
+        value = count = LightScheduler_eventsInRange(day, minute, arg, ids, MAX_RESULTS);
+        break;
+    case LSS_OP_STATS: {
+        LightSchedulerStats stats;
+        LightScheduler_getStats(&stats);
+        ids[0] = stats.events;
+        ids[1] = stats.staticEvents;
+        ids[2] = stats.freeSlots;
+        ids[3] = stats.groups;
+        ids[4] = stats.calendars;
+        ids[5] = (int32_t)stats.version;
+        count = 6;
+        break;
+    }
+    case LSS_OP_TURN_NOW:
+        value = (action == TURN_ON) ? turn_on_led_now(lightId)
+              : (action == TURN_OFF) ? turn_off_led_now(lightId) : -1;
+        break;
+    default:
+        value = -1;
+    }
+
+    if(count < 0) count = 0;
+    out[0] = op;
+    out[1] = (value < 0) ? 1 : 0;
+    put16(out + 2, (uint16_t)count);
+    put32(out + 4, value);
+    for(int i = 0; i < count; i++) put32(out + LSS_RESPONSE_HEADER_SIZE + 4 * i, ids[i]);
+    return LSS_RESPONSE_HEADER_SIZE + 4 * count;
+}
+
+// Serve the complete requests buffered for a client, within the budget and
+// as long as their responses fit in the output buffer
+static int serve(Client *c, int budget) {
+    int served = 0, pos = 0;
+    while(served < budget && c->inLen - pos >= LSS_REQUEST_SIZE
+          && (int)sizeof(c->out) - c->outLen >= MAX_RESPONSE_SIZE) {
+        c->outLen += handle_request(c->in + pos, c->out + c->outLen);
+        pos += LSS_REQUEST_SIZE;
+        served++;
+    }
+    memmove(c->in, c->in + pos, c->inLen - pos);
+    c->inLen -= pos;
+    return served;
+}
+
+// Send as much of the pending responses as the socket takes
+static int flush(Client *c) {
+    while(c->outLen > 0) {
+        ssize_t n = send(c->fd, c->out, c->outLen, MSG_NOSIGNAL);
+        if(n < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+        memmove(c->out, c->out + n, c->outLen - n);
+        c->outLen -= (int)n;
+    }
+    return 0;
+}
+
+// A client can be served when it sent a complete request and its output
+// buffer has room for the response: a client that does not read its
+// responses waits on POLLOUT instead of keeping the loop busy
+static bool has_pending_request(const Client *c) {
+    return c->fd >= 0 && c->inLen >= LSS_REQUEST_SIZE
+        && (int)sizeof(c->out) - c->outLen >= MAX_RESPONSE_SIZE;
+}
+
+int LightSchedulerServer_poll(int timeoutMs) {
+    struct pollfd fds[LSS_MAX_CLIENTS + 1];
+    int owner[LSS_MAX_CLIENTS + 1];
+    int n = 0;
+    if(listenFd < 0) return -1;
+
+    fds[n].fd = listenFd;
+    fds[n].events = POLLIN;
+    owner[n++] = -1;
+    for(int i = 0; i < LSS_MAX_CLIENTS; i++) {
+        Client *c = &clients[i];
+        if(c->fd < 0) continue;
+        if(has_pending_request(c)) timeoutMs = 0;   // Work left over from the last budget
+        fds[n].fd = c->fd;
+        fds[n].events = (!c->closing && c->inLen < (int)sizeof(c->in) ? POLLIN : 0)
+                      | (c->outLen > 0 ? POLLOUT : 0);
+        owner[n++] = i;
+    }
+    if(poll(fds, n, timeoutMs) < 0) return (errno == EINTR) ? 0 : -1;
+    if(fds[0].revents & POLLIN) accept_clients();
+
+    for(int k = 1; k < n; k++) {
+        Client *c = &clients[owner[k]];
+        if(fds[k].revents & POLLERR) {
+            drop_client(c);
+        } else if(fds[k].revents & POLLIN) {
+            ssize_t got = recv(c->fd, c->in + c->inLen, sizeof(c->in) - c->inLen, 0);
+            if(got == 0) {
+                c->closing = true;      // End of the batch: answer it before dropping the client
+            } else if(got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                drop_client(c);
+            } else if(got > 0) {
+                c->inLen += (int)got;
+            }
+        } else if(fds[k].revents & POLLHUP) {
+            c->closing = true;
+        }
+    }
+
+    // Split the budget evenly between the clients with requests, starting
+    // from a different one each call, so that a busy client cannot starve
+    // the others
+    int busy = 0, served = 0;
+    for(int i = 0; i < LSS_MAX_CLIENTS; i++) busy += has_pending_request(&clients[i]);
+    for(int j = 0; j < LSS_MAX_CLIENTS && busy > 0; j++) {
+        Client *c = &clients[(nextClient + j) % LSS_MAX_CLIENTS];
+        if(!has_pending_request(c)) continue;
+        served += serve(c, (LSS_POLL_BUDGET - served) / busy--);
+    }
+    nextClient = (nextClient + 1) % LSS_MAX_CLIENTS;
+
+    for(int i = 0; i < LSS_MAX_CLIENTS; i++) {
+        Client *c = &clients[i];
+        if(c->fd < 0) continue;
+        if(flush(c) < 0 || (c->closing && c->inLen < LSS_REQUEST_SIZE && c->outLen == 0)) drop_client(c);
+    }
+    return served;
+}
@@ -1,7 +1,17 @@
+#define _POSIX_C_SOURCE 200809L
 #include "MockTimeService.h"
 #include "LightScheduler.h"
+#include "LightScheduleShm.h"
+#include "LightSchedulerServer.h"
+#include "LightSchedulerCheck.h"
+#include "LightSchedule_example.h"
 #include "unity.h"
 #include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
 #include <cmock.h>
 
 // Mocks
@@ -16,6 +26,8 @@ void setUp(void) {
 }
 
 void tearDown(void) {
+    LightScheduler_setDriver(NULL);   // Tests that capture the output restore LightControl
+    LightSchedulerServer_close();     // No-op unless a socket test failed before closing
     LightScheduler_destroy(); // Clean up LightScheduler after each test
     CMock_Guts_MemFreeFinal(); 
 }
@@ -308,6 +320,9 @@ void test_scheduler_weekup_one_minute_before(){
     TEST_ASSERT_EQUAL(1, LightControlSpy_getLastLightId());
     TEST_ASSERT_EQUAL(LIGHT_ON,LightControlSpy_getLastState());
     TEST_ASSERT_TRUE(did_u_wake_me_up_one_minute_before(id));
+    TEST_ASSERT_FALSE(did_u_wake_me_up_one_minute_before(-1));
+    TEST_ASSERT_FALSE(did_u_wake_me_up_one_minute_before(id + 1));
+    TEST_ASSERT_FALSE(did_u_wake_me_up_one_minute_before(1 << 20));
 }
 
 
@@ -595,4 +610,807 @@ void test_the_time_of_the_scheduler_events_is_invalid(){
     TimeService_getTime_ReturnMemThruPtr_time(&currentTime,sizeof(currentTime));
     LightScheduler_wakeup();
     TEST_ASSERT_EQUAL(-1, i);
-}
\ No newline at end of file
+}
+
+// Test that the per-light query returns only the active events of that light,
+// in scheduling order, and forgets removed events
+void test_events_for_light_returns_only_its_active_events(){
+    int ids[8];
+    int a = LightScheduler_schedule(42, MONDAY, 8*60, TURN_ON);
+    LightScheduler_schedule(7, MONDAY, 8*60, TURN_ON);
+    int b = LightScheduler_schedule(42, WEEKEND, 9*60, TURN_OFF);
+    int c = LightScheduler_schedule(42, FRIDAY, 18*60, TURN_OFF);
+    TEST_ASSERT_EQUAL(3, LightScheduler_eventsForLight(42, ids, 8));
+    TEST_ASSERT_EQUAL(a, ids[0]);
+    TEST_ASSERT_EQUAL(b, ids[1]);
+    TEST_ASSERT_EQUAL(c, ids[2]);
+
+    LightScheduler_remove(b);
+    TEST_ASSERT_EQUAL(2, LightScheduler_eventsForLight(42, ids, 8));
+    TEST_ASSERT_EQUAL(a, ids[0]);
+    TEST_ASSERT_EQUAL(c, ids[1]);
+    TEST_ASSERT_EQUAL(1, LightScheduler_eventsForLight(42, ids, 1));
+    TEST_ASSERT_EQUAL(0, LightScheduler_eventsForLight(3, ids, 8));
+    TEST_ASSERT_EQUAL(-1, LightScheduler_eventsForLight(256, ids, 8));
+}
+
+// Test that the range query returns the events of one day, ordered by minute,
+// including the day patterns (WEEKDAY, EVERYDAY) that cover that day
+void test_events_in_range_returns_time_ordered_events_of_the_day(){
+    int ids[8];
+    int late = LightScheduler_schedule(1, FRIDAY, 18*60+45, TURN_OFF);
+    int early = LightScheduler_schedule(2, WEEKDAY, 18*60, TURN_ON);
+    LightScheduler_schedule(3, SATURDAY, 18*60+30, TURN_ON);
+    int daily = LightScheduler_schedule(4, EVERYDAY, 18*60+30, TURN_ON);
+    LightScheduler_schedule(5, FRIDAY, 19*60+1, TURN_ON);
+    TEST_ASSERT_EQUAL(3, LightScheduler_eventsInRange(FRIDAY, 18*60, 19*60, ids, 8));
+    TEST_ASSERT_EQUAL(early, ids[0]);
+    TEST_ASSERT_EQUAL(daily, ids[1]);
+    TEST_ASSERT_EQUAL(late, ids[2]);
+
+    LightScheduler_remove(daily);
+    TEST_ASSERT_EQUAL(2, LightScheduler_eventsInRange(FRIDAY, 18*60, 19*60, ids, 8));
+    TEST_ASSERT_EQUAL(early, ids[0]);
+    TEST_ASSERT_EQUAL(late, ids[1]);
+    TEST_ASSERT_EQUAL(0, LightScheduler_eventsInRange(SUNDAY, 18*60, 19*60, ids, 8));
+    TEST_ASSERT_EQUAL(-1, LightScheduler_eventsInRange(WEEKDAY, 18*60, 19*60, ids, 8));
+    TEST_ASSERT_EQUAL(-1, LightScheduler_eventsInRange(FRIDAY, 19*60, 18*60, ids, 8));
+}
+
+// Test that the expected state is the last event of each light before the
+// queried time, wrapping around the week, without simulating wakeups
+void test_state_at_uses_last_event_before_time(){
+    StateBitmap state;
+    LightScheduler_schedule(10, WEEKDAY, 8*60, TURN_ON);
+    LightScheduler_schedule(10, WEEKDAY, 18*60, TURN_OFF);
+    LightScheduler_schedule(11, SATURDAY, 12*60, TURN_ON);
+
+    TEST_ASSERT_EQUAL(0, LightScheduler_stateAt((Time){WEDNESDAY, 12*60}, &state));
+    TEST_ASSERT_TRUE(StateBitmap_isKnown(&state, 10));
+    TEST_ASSERT_TRUE(StateBitmap_isOn(&state, 10));
+    TEST_ASSERT_TRUE(StateBitmap_isKnown(&state, 11));
+    TEST_ASSERT_TRUE(StateBitmap_isOn(&state, 11));   // Still on since last Saturday
+    TEST_ASSERT_FALSE(StateBitmap_isKnown(&state, 12));
+
+    LightScheduler_stateAt((Time){MONDAY, 7*60+59}, &state);
+    TEST_ASSERT_FALSE(StateBitmap_isOn(&state, 10));  // Friday's TURN_OFF
+    LightScheduler_stateAt((Time){MONDAY, 8*60}, &state);
+    TEST_ASSERT_TRUE(StateBitmap_isOn(&state, 10));
+    LightScheduler_stateAt((Time){SUNDAY, 20*60}, &state);
+    TEST_ASSERT_FALSE(StateBitmap_isOn(&state, 10));
+
+    TEST_ASSERT_EQUAL(-1, LightScheduler_stateAt((Time){EVERYDAY, 0}, &state));
+    TEST_ASSERT_EQUAL(-1, LightScheduler_stateAt((Time){MONDAY, 24*60}, &state));
+}
+
+// Test that events of the same minute resolve like wakeup: the last scheduled wins
+void test_state_at_same_minute_last_scheduled_wins(){
+    StateBitmap state;
+    LightScheduler_schedule(20, MONDAY, 9*60, TURN_ON);
+    int off = LightScheduler_schedule(20, EVERYDAY, 9*60, TURN_OFF);
+    LightScheduler_stateAt((Time){MONDAY, 9*60}, &state);
+    TEST_ASSERT_FALSE(StateBitmap_isOn(&state, 20));
+    LightScheduler_remove(off);
+    LightScheduler_stateAt((Time){MONDAY, 9*60}, &state);
+    TEST_ASSERT_TRUE(StateBitmap_isOn(&state, 20));
+}
+
+// Test that the last scheduled event of a minute still wins when it reuses
+// the slot of a removed event, i.e. a lower id than the earlier event
+void test_same_minute_last_scheduled_wins_on_reused_slot(){
+    StateBitmap state;
+    int ids[4];
+    for(int i = 0; i < LIGHT_SCHEDULER_MAX_EVENTS - 1; i++) LightScheduler_schedule(200, SUNDAY, i, TURN_ON);
+    int on = LightScheduler_schedule(5, MONDAY, 10*60, TURN_ON);
+    TEST_ASSERT_EQUAL(LIGHT_SCHEDULER_MAX_EVENTS - 1, on);
+    TEST_ASSERT_EQUAL(0, LightScheduler_remove(10));
+    int off = LightScheduler_schedule(5, MONDAY, 10*60, TURN_OFF);
+    TEST_ASSERT_EQUAL(10, off & (LIGHT_SCHEDULER_STATIC_BASE - 1));
+
+    LightScheduler_wakeupAt((Time){MONDAY, 10*60});
+    TEST_ASSERT_EQUAL(5, LightControlSpy_getLastLightId());
+    TEST_ASSERT_EQUAL(LIGHT_OFF, LightControlSpy_getLastState());
+    LightScheduler_stateAt((Time){MONDAY, 10*60}, &state);
+    TEST_ASSERT_FALSE(StateBitmap_isOn(&state, 5));
+    TEST_ASSERT_EQUAL(2, LightScheduler_eventsInRange(MONDAY, 10*60, 10*60, ids, 4));
+    TEST_ASSERT_EQUAL(on, ids[0]);
+    TEST_ASSERT_EQUAL(off, ids[1]);
+}
+
+// Test that reconcile only sends the lights whose actual state is wrong
+void test_reconcile_sends_only_differences(){
+    StateBitmap actual = {{0}, {0}};
+    LightScheduler_schedule(30, MONDAY, 8*60, TURN_ON);
+    LightScheduler_schedule(31, MONDAY, 8*60, TURN_ON);
+    actual.known[0] = (1u << 30) | (1u << 31);
+    actual.on[0] = 1u << 31;    // 31 is already on, 30 is off
+    set_time(TUESDAY, 10*60);
+    TimeService_getTime_ExpectAnyArgs();
+    TimeService_getTime_ReturnMemThruPtr_time(&currentTime,sizeof(currentTime));
+    TEST_ASSERT_EQUAL(1, LightScheduler_reconcile(&actual));
+    TEST_ASSERT_EQUAL(30, LightControlSpy_getLastLightId());
+    TEST_ASSERT_EQUAL(LIGHT_ON,LightControlSpy_getLastState());
+
+    TimeService_getTime_ExpectAnyArgs();
+    TimeService_getTime_ReturnMemThruPtr_time(&currentTime,sizeof(currentTime));
+    TEST_ASSERT_EQUAL(2, LightScheduler_reconcile(NULL));
+}
+
+// Table laid out like tools/generate_schedule.rb output for:
+//   5 MONDAY 08:00 ON / 5 EVERYDAY 20:00 OFF
+// (the 256/257 entry arrays are filled by init_static_table to keep it short)
+static const ScheduledEvent staticEvents[] = {
+    { .id = 0, .lightId = 5, .day = MONDAY, .minute = 480, .action = TURN_ON, .active = true, .one_minute_befores = true, .nextForLight = 1, .prevForLight = -1 },
+    { .id = 1, .lightId = 5, .day = EVERYDAY, .minute = 1200, .action = TURN_OFF, .active = true, .one_minute_befores = true, .nextForLight = -1, .prevForLight = 0 }
+};
+static int staticLightHead[256];
+static const int staticDayIndex[] = { 0, 1, 1, 1, 1, 1, 1, 1 };
+static const ScheduleTransition staticTransitions[] = {
+    { 480, 0, TURN_ON }, { 1200, 1, TURN_OFF }, { 2640, 1, TURN_OFF }, { 4080, 1, TURN_OFF },
+    { 5520, 1, TURN_OFF }, { 6960, 1, TURN_OFF }, { 8400, 1, TURN_OFF }, { 9840, 1, TURN_OFF }
+};
+static int staticTransitionStart[257];
+static const LightScheduleTable staticTable = {
+    .events = staticEvents,
+    .eventCount = 2,
+    .lightHead = staticLightHead,
+    .dayIndex = { staticDayIndex + 0, staticDayIndex + 2, staticDayIndex + 3, staticDayIndex + 4,
+                  staticDayIndex + 5, staticDayIndex + 6, staticDayIndex + 7 },
+    .dayCount = { 2, 1, 1, 1, 1, 1, 1 },
+    .transitions = staticTransitions,
+    .transitionStart = staticTransitionStart
+};
+
+static void init_static_table(void) {
+    for(int l = 0; l < 256; l++) {
+        staticLightHead[l] = (l == 5) ? 0 : -1;
+        staticTransitionStart[l + 1] = (l >= 5) ? 8 : 0;
+    }
+    TimeService_startPeriodicAlarm_ExpectAndReturn(60, LightScheduler_wakeup, 0);
+    LightScheduler_initStatic(&staticTable);
+}
+
+// Test that the scheduler runs directly from a read-only table
+void test_static_table_fires_and_answers_queries(){
+    int ids[4];
+    StateBitmap state;
+    init_static_table();
+    turn_off_led_now(5);
+    set_time(MONDAY, 8*60);
+    TimeService_getTime_ExpectAnyArgs();
+    TimeService_getTime_ReturnMemThruPtr_time(&currentTime,sizeof(currentTime));
+    LightScheduler_wakeup();
+    TEST_ASSERT_EQUAL(5, LightControlSpy_getLastLightId());
+    TEST_ASSERT_EQUAL(LIGHT_ON,LightControlSpy_getLastState());
+
+    TEST_ASSERT_EQUAL(2, LightScheduler_eventsForLight(5, ids, 4));
+    TEST_ASSERT_EQUAL(LIGHT_SCHEDULER_STATIC_BASE + 0, ids[0]);
+    TEST_ASSERT_EQUAL(LIGHT_SCHEDULER_STATIC_BASE + 1, ids[1]);
+    LightScheduler_stateAt((Time){MONDAY, 12*60}, &state);
+    TEST_ASSERT_TRUE(StateBitmap_isOn(&state, 5));
+    LightScheduler_stateAt((Time){TUESDAY, 12*60}, &state);
+    TEST_ASSERT_FALSE(StateBitmap_isOn(&state, 5));
+}
+
+// Test that runtime edits go to the overlay and removing a static event masks it
+void test_static_table_overlay_and_removal(){
+    int ids[4];
+    init_static_table();
+    int extra = LightScheduler_schedule(5, MONDAY, 8*60, TURN_OFF);
+    TEST_ASSERT_EQUAL(3, LightScheduler_eventsInRange(MONDAY, 0, 23*60+59, ids, 4));
+    TEST_ASSERT_EQUAL(LIGHT_SCHEDULER_STATIC_BASE + 0, ids[0]);
+    TEST_ASSERT_EQUAL(extra, ids[1]);
+    TEST_ASSERT_EQUAL(LIGHT_SCHEDULER_STATIC_BASE + 1, ids[2]);
+
+    turn_on_led_now(5);
+    set_time(MONDAY, 8*60);
+    TimeService_getTime_ExpectAnyArgs();
+    TimeService_getTime_ReturnMemThruPtr_time(&currentTime,sizeof(currentTime));
+    LightScheduler_wakeup();
+    TEST_ASSERT_EQUAL(LIGHT_OFF,LightControlSpy_getLastState());   // Overlay fires last
+
+    TEST_ASSERT_EQUAL(0, LightScheduler_remove(extra));
+    TEST_ASSERT_TRUE(did_u_wake_me_up_one_minute_before(LIGHT_SCHEDULER_STATIC_BASE + 0));
+    TEST_ASSERT_EQUAL(0, LightScheduler_remove(LIGHT_SCHEDULER_STATIC_BASE + 0));
+    TEST_ASSERT_FALSE(did_u_wake_me_up_one_minute_before(LIGHT_SCHEDULER_STATIC_BASE + 0));
+    TEST_ASSERT_EQUAL(-1, LightScheduler_remove(LIGHT_SCHEDULER_STATIC_BASE + 0));
+    TEST_ASSERT_EQUAL(-1, LightScheduler_remove(LIGHT_SCHEDULER_STATIC_BASE + 2));
+    turn_off_led_now(5);
+    TimeService_getTime_ExpectAnyArgs();
+    TimeService_getTime_ReturnMemThruPtr_time(&currentTime,sizeof(currentTime));
+    LightScheduler_wakeup();
+    TEST_ASSERT_EQUAL(LIGHT_OFF,LightControlSpy_getLastState());
+    TEST_ASSERT_EQUAL(1, LightScheduler_eventsForLight(5, ids, 4));
+}
+
+// schedules/example.sched, scheduled at runtime to check the generated table
+static const ScheduleEntry exampleEntries[] = {
+    { .lightId = 10, .day = WEEKDAY, .minute = 7*60+30, .action = TURN_ON },
+    { .lightId = 10, .day = WEEKDAY, .minute = 19*60, .action = TURN_OFF },
+    { .lightId = 11, .day = WEEKDAY, .minute = 7*60+30, .action = TURN_ON },
+    { .lightId = 11, .day = WEEKDAY, .minute = 19*60, .action = TURN_OFF },
+    { .lightId = 42, .day = EVERYDAY, .minute = 18*60+30, .action = TURN_ON },
+    { .lightId = 42, .day = EVERYDAY, .minute = 6*60, .action = TURN_OFF },
+    { .lightId = 50, .day = WEEKEND, .minute = 22*60, .action = TURN_ON },
+    { .lightId = 50, .day = WEEKEND, .minute = 22*60+15, .action = TURN_OFF },
+};
+static const int exampleLights[] = { 10, 11, 42, 50 };
+
+// Driver recording every command with the minute of the week it was sent at
+static int weekLog[64][3];
+static int weekLogCount, weekMinute;
+static void log_command(int id, int action) {
+    if(weekLogCount < 64) {
+        weekLog[weekLogCount][0] = weekMinute;
+        weekLog[weekLogCount][1] = id;
+        weekLog[weekLogCount][2] = action;
+    }
+    weekLogCount++;
+}
+static void log_on(int id) { log_command(id, TURN_ON); }
+static void log_off(int id) { log_command(id, TURN_OFF); }
+static void log_many(const LightSet *lights) { (void)lights; log_command(-1, -1); }
+static const LightDriver weekLogDriver = { log_on, log_off, log_many, log_many };
+
+// Tick every minute of the week, logging the commands and the state of the
+// example lights (-1 unknown, 0 off, 1 on)
+static void run_example_week(signed char states[][4]) {
+    StateBitmap state;
+    weekLogCount = 0;
+    LightScheduler_setDriver(&weekLogDriver);
+    for(weekMinute = 0; weekMinute < 7*24*60; weekMinute++) {
+        Time t = { (WeekDay)(MONDAY + weekMinute / (24*60)), weekMinute % (24*60) };
+        LightScheduler_wakeupAt(t);
+        LightScheduler_stateAt(t, &state);
+        for(int i = 0; i < 4; i++) {
+            int l = exampleLights[i];
+            states[weekMinute][i] = !StateBitmap_isKnown(&state, l) ? -1 : StateBitmap_isOn(&state, l);
+        }
+    }
+    LightScheduler_setDriver(NULL);
+}
+
+// Test that the table generated from schedules/example.sched fires the same
+// commands and implies the same states as the same events scheduled at
+// runtime, at every minute of the week
+void test_generated_example_table_matches_runtime_schedule(){
+    static signed char runtimeStates[7*24*60][4], staticStates[7*24*60][4];
+    static int runtimeLog[64][3];
+    int ids[8];
+    TEST_ASSERT_EQUAL(8, LightScheduler_apply(exampleEntries, 8, NULL));
+    run_example_week(runtimeStates);
+    int runtimeCount = weekLogCount;
+    memcpy(runtimeLog, weekLog, sizeof(weekLog));
+    TEST_ASSERT_EQUAL(38, runtimeCount);
+
+    TimeService_startPeriodicAlarm_ExpectAndReturn(60, LightScheduler_wakeup, 0);
+    LightScheduler_initStatic(&LightSchedule_example);
+    run_example_week(staticStates);
+    TEST_ASSERT_EQUAL(runtimeCount, weekLogCount);
+    TEST_ASSERT_EQUAL(0, memcmp(runtimeLog, weekLog, sizeof(weekLog)));
+    TEST_ASSERT_EQUAL(0, memcmp(runtimeStates, staticStates, sizeof(staticStates)));
+
+    // Generated slots are ordered by minute: 42 OFF at 06:00 is the first one
+    TEST_ASSERT_EQUAL(2, LightScheduler_eventsForLight(42, ids, 8));
+    TEST_ASSERT_EQUAL(LIGHT_SCHEDULER_STATIC_BASE + 0, ids[0]);
+    TEST_ASSERT_EQUAL(LIGHT_SCHEDULER_STATIC_BASE + 3, ids[1]);
+    TEST_ASSERT_EQUAL(4, LightScheduler_eventsInRange(SATURDAY, 0, 23*60+59, ids, 8));
+    TEST_ASSERT_EQUAL(LIGHT_SCHEDULER_STATIC_BASE + 6, ids[2]);
+    TEST_ASSERT_EQUAL(0, LightScheduler_eventsForLight(12, ids, 8));
+}
+
+// Test that applying a new profile keeps the handles of unchanged events and
+// only removes/adds the differences, without resetting the driver
+void test_apply_keeps_unchanged_events(){
+    int ids[8];
+    int keep = LightScheduler_schedule(1, WEEKDAY, 7*60, TURN_ON);
+    int drop = LightScheduler_schedule(1, WEEKDAY, 19*60, TURN_OFF);
+    ScheduleEntry winter[] = {
+        { .lightId = 1, .day = WEEKDAY, .minute = 7*60, .action = TURN_ON },
+        { .lightId = 1, .day = WEEKDAY, .minute = 17*60, .action = TURN_OFF },
+    };
+    int handles[2];
+    turn_on_led_now(9);
+    TEST_ASSERT_EQUAL(2, LightScheduler_apply(winter, 2, handles));
+    TEST_ASSERT_EQUAL(keep, handles[0]);
+    TEST_ASSERT_NOT_EQUAL(-1, handles[1]);
+    TEST_ASSERT_EQUAL(9, LightControlSpy_getLastLightId());    // Driver was not re-initialized
+
+    TEST_ASSERT_EQUAL(2, LightScheduler_eventsForLight(1, ids, 8));
+    TEST_ASSERT_EQUAL(keep, ids[0]);
+    TEST_ASSERT_EQUAL(handles[1], ids[1]);
+    TEST_ASSERT_NOT_EQUAL(drop, ids[1]);
+    TEST_ASSERT_EQUAL(0, LightScheduler_eventsInRange(MONDAY, 19*60, 19*60, ids, 8));
+
+    TEST_ASSERT_EQUAL(0, LightScheduler_apply(winter, 2, NULL));    // Nothing to change
+    TEST_ASSERT_EQUAL(2, LightScheduler_apply(NULL, 0, NULL));      // Empty profile
+    TEST_ASSERT_EQUAL(0, LightScheduler_eventsForLight(1, ids, 8));
+}
+
+// Test that an apply that would not fit changes nothing, and that removed
+// slots are reused once the table has been filled, under a new handle
+void test_apply_is_all_or_nothing(){
+    static ScheduleEntry full[257];
+    int ids[4];
+    for(int i = 0; i < 257; i++) {
+        full[i] = (ScheduleEntry){ .lightId = i % 256, .day = MONDAY, .minute = i, .action = TURN_ON };
+    }
+    int keep = LightScheduler_schedule(3, SUNDAY, 0, TURN_OFF);
+    TEST_ASSERT_EQUAL(-1, LightScheduler_apply(full, 257, NULL));
+    TEST_ASSERT_EQUAL(1, LightScheduler_eventsForLight(3, ids, 4));
+    TEST_ASSERT_EQUAL(keep, ids[0]);
+
+    TEST_ASSERT_EQUAL(257, LightScheduler_apply(full, 256, NULL));
+    TEST_ASSERT_EQUAL(-1, LightScheduler_schedule(3, SUNDAY, 0, TURN_OFF));
+    TEST_ASSERT_EQUAL(0, LightScheduler_remove(10));
+    int reused = LightScheduler_schedule(3, SUNDAY, 0, TURN_OFF);
+    TEST_ASSERT_NOT_EQUAL(-1, reused);
+    TEST_ASSERT_NOT_EQUAL(10, reused);
+    TEST_ASSERT_EQUAL(10, reused & (LIGHT_SCHEDULER_STATIC_BASE - 1));    // Same slot
+    TEST_ASSERT_EQUAL(-1, LightScheduler_remove(10));     // Stale handle: the new event of the slot stays
+    TEST_ASSERT_FALSE(did_u_wake_me_up_one_minute_before(10));
+    TEST_ASSERT_TRUE(did_u_wake_me_up_one_minute_before(reused));
+    TEST_ASSERT_EQUAL(-1, LightScheduler_setEventCalendar(10, 0, CALENDAR_NONE));
+    TEST_ASSERT_EQUAL(2, LightScheduler_eventsForLight(3, ids, 4));
+    TEST_ASSERT_EQUAL(reused, ids[1]);
+
+    full[0].lightId = 300;
+    TEST_ASSERT_EQUAL(-1, LightScheduler_apply(full, 1, NULL));
+}
+
+// Helper function to set mock time with a calendar date
+static void set_date(WeekDay day, int minute, int year, int dayOfYear) {
+    set_time(day, minute);
+    currentTime.year = year;
+    currentTime.dayOfYear = dayOfYear;
+}
+
+// Test that an event excluded on holidays does not fire on a holiday date,
+// and still fires on other dates and when the date is unknown
+void test_calendar_except_skips_holidays(){
+    int holidays = LightScheduler_defineCalendar("holidays");
+    TEST_ASSERT_EQUAL(0, LightScheduler_calendarAddDate(holidays, 2026, 12, 25));   // Friday
+    int id = LightScheduler_schedule(7, WEEKDAY, 8*60, TURN_ON);
+    TEST_ASSERT_EQUAL(0, LightScheduler_setEventCalendar(id, holidays, CALENDAR_EXCEPT));
+
+    turn_off_led_now(7);
+    set_date(FRIDAY, 8*60, 2026, 359);
+    TimeService_getTime_ExpectAnyArgs();
+    TimeService_getTime_ReturnMemThruPtr_time(&currentTime,sizeof(currentTime));
+    LightScheduler_wakeup();
+    TEST_ASSERT_EQUAL(LIGHT_OFF,LightControlSpy_getLastState());
+
+    set_date(THURDSDAY, 8*60, 2026, 358);
+    TimeService_getTime_ExpectAnyArgs();
+    TimeService_getTime_ReturnMemThruPtr_time(&currentTime,sizeof(currentTime));
+    LightScheduler_wakeup();
+    TEST_ASSERT_EQUAL(LIGHT_ON,LightControlSpy_getLastState());
+
+    turn_off_led_now(7);
+    set_date(FRIDAY, 8*60, 0, 359);     // Date unknown
+    TimeService_getTime_ExpectAnyArgs();
+    TimeService_getTime_ReturnMemThruPtr_time(&currentTime,sizeof(currentTime));
+    LightScheduler_wakeup();
+    TEST_ASSERT_EQUAL(LIGHT_ON,LightControlSpy_getLastState());
+}
+
+// Test that an event restricted to a calendar only fires on its dates, never
+// when the date is unknown, and that stateAt follows the same rule
+void test_calendar_only_fires_on_listed_dates(){
+    StateBitmap state;
+    int eve = LightScheduler_defineCalendar("christmas-eve");
+    TEST_ASSERT_EQUAL(eve, LightScheduler_findCalendar("christmas-eve"));
+    TEST_ASSERT_EQUAL(eve, LightScheduler_defineCalendar("christmas-eve"));
+    LightScheduler_calendarAddDate(eve, 2026, 12, 24);
+    int on = LightScheduler_schedule(8, EVERYDAY, 18*60, TURN_ON);
+    LightScheduler_schedule(8, EVERYDAY, 23*60, TURN_OFF);
+    LightScheduler_setEventCalendar(on, eve, CALENDAR_ONLY);
+
+    turn_off_led_now(8);
+    set_date(WEDNESDAY, 18*60, 2026, 357);
+    TimeService_getTime_ExpectAnyArgs();
+    TimeService_getTime_ReturnMemThruPtr_time(&currentTime,sizeof(currentTime));
+    LightScheduler_wakeup();
+    TEST_ASSERT_EQUAL(LIGHT_OFF,LightControlSpy_getLastState());
+
+    set_date(THURDSDAY, 18*60, 2026, 358);
+    TimeService_getTime_ExpectAnyArgs();
+    TimeService_getTime_ReturnMemThruPtr_time(&currentTime,sizeof(currentTime));
+    LightScheduler_wakeup();
+    TEST_ASSERT_EQUAL(LIGHT_ON,LightControlSpy_getLastState());
+
+    turn_off_led_now(8);
+    set_date(THURDSDAY, 18*60, 0, 358);
+    TimeService_getTime_ExpectAnyArgs();
+    TimeService_getTime_ReturnMemThruPtr_time(&currentTime,sizeof(currentTime));
+    LightScheduler_wakeup();
+    TEST_ASSERT_EQUAL(LIGHT_OFF,LightControlSpy_getLastState());
+
+    LightScheduler_stateAt((Time){THURDSDAY, 20*60, 2026, 358}, &state);
+    TEST_ASSERT_TRUE(StateBitmap_isOn(&state, 8));
+    LightScheduler_stateAt((Time){WEDNESDAY, 20*60, 2026, 357}, &state);
+    TEST_ASSERT_FALSE(StateBitmap_isOn(&state, 8));
+}
+
+// Test that invalid calendar input is rejected
+void test_calendar_invalid_input(){
+    int c = LightScheduler_defineCalendar("closures");
+    TEST_ASSERT_EQUAL(-1, LightScheduler_defineCalendar(""));
+    TEST_ASSERT_EQUAL(-1, LightScheduler_findCalendar("unknown"));
+    TEST_ASSERT_EQUAL(-1, LightScheduler_calendarAddDate(c, 2026, 2, 29));
+    TEST_ASSERT_EQUAL(0, LightScheduler_calendarAddDate(c, 2028, 2, 29));
+    TEST_ASSERT_EQUAL(-1, LightScheduler_calendarAddDate(c, 2026, 13, 1));
+    TEST_ASSERT_EQUAL(-1, LightScheduler_calendarAddDate(c + 1, 2026, 1, 1));
+    int id = LightScheduler_schedule(1, MONDAY, 0, TURN_ON);
+    TEST_ASSERT_EQUAL(-1, LightScheduler_setEventCalendar(id, c + 1, CALENDAR_ONLY));
+    TEST_ASSERT_EQUAL(-1, LightScheduler_setEventCalendar(id + 1, c, CALENDAR_ONLY));
+}
+
+// Test that one group event switches all the lights of the group with a
+// single batched driver call
+void test_group_event_fires_one_batched_update(){
+    int floor = LightScheduler_defineGroupRange(100, 199);
+    TEST_ASSERT_EQUAL(1, floor);
+    int id = LightScheduler_scheduleGroup(floor, WEEKDAY, 7*60, TURN_ON);
+    TEST_ASSERT_NOT_EQUAL(-1, id);
+
+    set_time(MONDAY, 7*60);
+    TimeService_getTime_ExpectAnyArgs();
+    TimeService_getTime_ReturnMemThruPtr_time(&currentTime,sizeof(currentTime));
+    LightScheduler_wakeup();
+    TEST_ASSERT_EQUAL(1, LightControlSpy_getBatchCount());
+    TEST_ASSERT_EQUAL(199, LightControlSpy_getLastLightId());
+    TEST_ASSERT_EQUAL(LIGHT_ON,LightControlSpy_getLastState());
+
+    set_time(SATURDAY, 7*60);
+    TimeService_getTime_ExpectAnyArgs();
+    TimeService_getTime_ReturnMemThruPtr_time(&currentTime,sizeof(currentTime));
+    LightScheduler_wakeup();
+    TEST_ASSERT_EQUAL(1, LightControlSpy_getBatchCount());
+}
+
+// Test that group events show up in the per-light query and in stateAt,
+// where a later single-light event overrides the group
+void test_group_event_queries_and_state(){
+    int ids[4];
+    StateBitmap state;
+    int lights[] = { 3, 5, 8 };
+    int group = LightScheduler_defineGroup(lights, 3);
+    int on = LightScheduler_scheduleGroup(group, EVERYDAY, 8*60, TURN_ON);
+    int off = LightScheduler_schedule(5, EVERYDAY, 9*60, TURN_OFF);
+
+    TEST_ASSERT_EQUAL(2, LightScheduler_eventsForLight(5, ids, 4));
+    TEST_ASSERT_EQUAL(off, ids[0]);
+    TEST_ASSERT_EQUAL(on, ids[1]);
+    TEST_ASSERT_EQUAL(0, LightScheduler_eventsForLight(4, ids, 4));
+
+    LightScheduler_stateAt((Time){TUESDAY, 10*60}, &state);
+    TEST_ASSERT_TRUE(StateBitmap_isOn(&state, 3));
+    TEST_ASSERT_FALSE(StateBitmap_isOn(&state, 5));
+    TEST_ASSERT_TRUE(StateBitmap_isKnown(&state, 5));
+    TEST_ASSERT_FALSE(StateBitmap_isKnown(&state, 4));
+    LightScheduler_stateAt((Time){TUESDAY, 8*60+30}, &state);
+    TEST_ASSERT_TRUE(StateBitmap_isOn(&state, 5));
+
+    TEST_ASSERT_EQUAL(-1, LightScheduler_scheduleGroup(group + 1, MONDAY, 0, TURN_ON));
+    TEST_ASSERT_EQUAL(-1, LightScheduler_defineGroupRange(10, 256));
+
+    int other = LightScheduler_defineGroupRange(5, 6);
+    int late = LightScheduler_scheduleGroup(other, EVERYDAY, 21*60, TURN_OFF);
+    TEST_ASSERT_EQUAL(3, LightScheduler_eventsForLight(5, ids, 4));
+    TEST_ASSERT_EQUAL(late, ids[2]);
+    TEST_ASSERT_EQUAL(1, LightScheduler_eventsForLight(6, ids, 4));
+    TEST_ASSERT_EQUAL(1, LightScheduler_eventsForLight(3, ids, 4));
+    LightScheduler_stateAt((Time){WEDNESDAY, 7*60}, &state);   // Last firings were on Tuesday night
+    TEST_ASSERT_FALSE(StateBitmap_isOn(&state, 6));
+    TEST_ASSERT_TRUE(StateBitmap_isOn(&state, 3));
+}
+
+// Test that another process can map the shared table read-only and take
+// consistent snapshots that follow the scheduler's edits
+void test_shared_table_snapshot_follows_edits(){
+    LightScheduleReader reader;
+    ScheduledEvent snapshot[256];
+    uint32_t version;
+    int id = LightScheduler_schedule(12, MONDAY, 6*60, TURN_ON);
+    TEST_ASSERT_EQUAL(0, LightScheduler_share("/light_scheduler_test"));
+    TEST_ASSERT_EQUAL(0, LightScheduleReader_open(&reader, "/light_scheduler_test"));
+    TEST_ASSERT_TRUE(LightScheduleShm_create("/light_scheduler_test") == NULL);   // Owned by this scheduler
+
+    TEST_ASSERT_EQUAL(1, LightScheduleReader_snapshot(&reader, snapshot, 256, &version));
+    TEST_ASSERT_EQUAL(LightScheduler_version(), version);
+    TEST_ASSERT_EQUAL(12, snapshot[id].lightId);
+    TEST_ASSERT_TRUE(snapshot[id].active);
+
+    int other = LightScheduler_schedule(13, TUESDAY, 7*60, TURN_OFF);
+    LightScheduler_remove(id);
+    TEST_ASSERT_EQUAL(LightScheduler_version(), LightScheduleReader_version(&reader));
+    TEST_ASSERT_EQUAL(2, LightScheduleReader_snapshot(&reader, snapshot, 256, &version));
+    TEST_ASSERT_FALSE(snapshot[id].active);
+    TEST_ASSERT_EQUAL(13, snapshot[other].lightId);
+
+    // Edits that change nothing do not publish a new version
+    ScheduleEntry same = { .lightId = 13, .day = TUESDAY, .minute = 7*60, .action = TURN_OFF };
+    LightScheduler_remove(id);
+    LightScheduler_remove(-5);
+    TEST_ASSERT_EQUAL(0, LightScheduler_apply(&same, 1, NULL));
+    TEST_ASSERT_EQUAL(version, LightScheduler_version());
+    TEST_ASSERT_EQUAL(version, LightScheduleReader_version(&reader));
+
+    LightScheduleReader_close(&reader);
+    LightScheduler_unshare();
+    TEST_ASSERT_EQUAL(-1, LightScheduleReader_open(&reader, "/light_scheduler_test"));
+    int ids[2];
+    TEST_ASSERT_EQUAL(1, LightScheduler_eventsForLight(13, ids, 2));    // Table is back in private memory
+}
+
+// Test that the static table and the static events removed at runtime are
+// published in the segment too
+void test_shared_table_publishes_static_table(){
+    LightScheduleReader reader;
+    ScheduledEvent snapshot[256];
+    uint32_t removed[8];
+    uint32_t version;
+    init_static_table();
+    TEST_ASSERT_EQUAL(0, LightScheduler_share("/light_scheduler_test"));
+    TEST_ASSERT_EQUAL(0, LightScheduleReader_open(&reader, "/light_scheduler_test"));
+
+    TEST_ASSERT_EQUAL(2, LightScheduleReader_snapshotStatic(&reader, snapshot, 256, removed, &version));
+    TEST_ASSERT_EQUAL(1200, snapshot[1].minute);
+    TEST_ASSERT_EQUAL(0, removed[0]);
+    TEST_ASSERT_EQUAL(0, LightScheduleReader_snapshot(&reader, snapshot, 256, NULL));
+
+    LightScheduler_remove(LIGHT_SCHEDULER_STATIC_BASE + 0);
+    TEST_ASSERT_EQUAL(2, LightScheduleReader_snapshotStatic(&reader, snapshot, 256, removed, &version));
+    TEST_ASSERT_EQUAL(1, removed[0]);
+    TEST_ASSERT_EQUAL(LightScheduler_version(), version);
+
+    LightScheduler_clear();
+    TEST_ASSERT_EQUAL(0, LightScheduleReader_snapshotStatic(&reader, snapshot, 256, removed, NULL));
+    TEST_ASSERT_EQUAL(0, removed[0]);
+
+    LightScheduleReader_close(&reader);
+    LightScheduler_unshare();
+}
+
+// Test that groups and calendars are published in the segment, and that
+// defining them commits a new version like any other edit
+void test_shared_table_publishes_groups_and_calendars(){
+    LightScheduleReader reader;
+    LightSet groups[LIGHT_SCHEDULER_MAX_GROUPS];
+    LightScheduleCalendar calendars[LIGHT_SCHEDULER_MAX_CALENDARS];
+    uint32_t version;
+    TEST_ASSERT_EQUAL(0, LightScheduler_share("/light_scheduler_test"));
+    TEST_ASSERT_EQUAL(0, LightScheduleReader_open(&reader, "/light_scheduler_test"));
+    TEST_ASSERT_EQUAL(0, LightScheduleReader_snapshotGroups(&reader, groups, LIGHT_SCHEDULER_MAX_GROUPS, NULL));
+
+    uint32_t before = LightScheduler_version();
+    TEST_ASSERT_EQUAL(1, LightScheduler_defineGroupRange(40, 41));
+    TEST_ASSERT_EQUAL(before + 1, LightScheduleReader_version(&reader));
+    TEST_ASSERT_EQUAL(1, LightScheduleReader_snapshotGroups(&reader, groups, LIGHT_SCHEDULER_MAX_GROUPS, &version));
+    TEST_ASSERT_EQUAL(LightScheduler_version(), version);
+    TEST_ASSERT_EQUAL(3u << 8, groups[0].bits[1]);
+
+    int holidays = LightScheduler_defineCalendar("holidays");
+    TEST_ASSERT_EQUAL(0, LightScheduler_calendarAddDate(holidays, 2024, 2, 1));
+    TEST_ASSERT_EQUAL(before + 3, LightScheduleReader_version(&reader));
+    TEST_ASSERT_EQUAL(1, LightScheduleReader_snapshotCalendars(&reader, calendars, LIGHT_SCHEDULER_MAX_CALENDARS, &version));
+    TEST_ASSERT_EQUAL_STRING("holidays", calendars[0].name);
+    TEST_ASSERT_EQUAL(2024, calendars[0].years[0]);
+    TEST_ASSERT_EQUAL(1u << 31, calendars[0].days[0][0]);       // February 1st is day 32
+
+    // Adding a date twice or an invalid date changes nothing
+    TEST_ASSERT_EQUAL(0, LightScheduler_calendarAddDate(holidays, 2024, 2, 1));
+    TEST_ASSERT_EQUAL(-1, LightScheduler_calendarAddDate(holidays, 2024, 2, 30));
+    TEST_ASSERT_EQUAL(before + 3, LightScheduleReader_version(&reader));
+
+    LightScheduler_clear();
+    TEST_ASSERT_EQUAL(before + 4, LightScheduleReader_version(&reader));
+    TEST_ASSERT_EQUAL(0, LightScheduleReader_snapshotGroups(&reader, groups, LIGHT_SCHEDULER_MAX_GROUPS, NULL));
+    TEST_ASSERT_EQUAL(0, LightScheduleReader_snapshotCalendars(&reader, calendars, LIGHT_SCHEDULER_MAX_CALENDARS, NULL));
+
+    LightScheduleReader_close(&reader);
+    LightScheduler_unshare();
+}
+
+// Test that readers give up on a segment the scheduler never published (it
+// crashed while creating it) instead of waiting forever
+void test_shared_table_reader_gives_up_on_unpublished_segment(){
+    LightScheduleReader reader;
+    ScheduledEvent snapshot[4];
+    uint32_t removed[8];
+    LightScheduleSegment *stuck = LightScheduleShm_create("/light_scheduler_stuck");
+    TEST_ASSERT_NOT_NULL(stuck);
+    TEST_ASSERT_EQUAL(0, LightScheduleReader_open(&reader, "/light_scheduler_stuck"));
+    TEST_ASSERT_EQUAL(-1, LightScheduleReader_snapshot(&reader, snapshot, 4, NULL));
+    TEST_ASSERT_EQUAL(-1, LightScheduleReader_snapshotStatic(&reader, snapshot, 4, removed, NULL));
+    LightScheduleReader_close(&reader);
+    LightScheduleShm_destroy(stuck, "/light_scheduler_stuck");
+}
+
+// Build one 12-byte request of the socket protocol
+static void put_request(uint8_t *req, int op, int action, int lightId, int day, int minute, int32_t arg) {
+    int16_t v;
+    req[0] = (uint8_t)op;
+    req[1] = (uint8_t)action;
+    v = (int16_t)lightId; memcpy(req + 2, &v, 2);
+    v = (int16_t)day;     memcpy(req + 4, &v, 2);
+    v = (int16_t)minute;  memcpy(req + 6, &v, 2);
+    memcpy(req + 8, &arg, 4);
+}
+
+// Test that a pipelined batch sent over the command socket is executed in
+// order and answered with one response per request
+void test_command_socket_pipelined_batch(){
+    const char *path = "/tmp/light_scheduler_test.sock";
+    uint8_t batch[5 * LSS_REQUEST_SIZE];
+    uint8_t reply[256];
+    int got = 0;
+    TEST_ASSERT_EQUAL(0, LightSchedulerServer_open(path));
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strcpy(addr.sun_path, path);
+    TEST_ASSERT_EQUAL(0, connect(fd, (struct sockaddr *)&addr, sizeof(addr)));
+
+    put_request(batch + 0,  LSS_OP_SCHEDULE, TURN_ON, 77, FRIDAY, 18*60, 0);
+    put_request(batch + 12, LSS_OP_SCHEDULE, TURN_OFF, 77, FRIDAY, 23*60, 0);
+    put_request(batch + 24, LSS_OP_QUERY_LIGHT, 0, 77, 0, 0, 0);
+    put_request(batch + 36, LSS_OP_TURN_NOW, TURN_ON, 300, 0, 0, 0);
+    put_request(batch + 48, LSS_OP_REMOVE, 0, 0, 0, 0, 4242);
+    TEST_ASSERT_EQUAL(sizeof(batch), write(fd, batch, sizeof(batch)));
+    for(int i = 0; i < 50 && got < 48; i++) {
+        LightSchedulerServer_poll(10);
+        ssize_t n = recv(fd, reply + got, sizeof(reply) - got, MSG_DONTWAIT);
+        if(n > 0) got += n;
+    }
+    TEST_ASSERT_EQUAL(8 + 8 + 16 + 8 + 8, got);
+
+    int32_t value;
+    memcpy(&value, reply + 4, 4);
+    TEST_ASSERT_EQUAL(LSS_OP_SCHEDULE, reply[0]);
+    TEST_ASSERT_EQUAL(0, reply[1]);
+    int first = value;
+    TEST_ASSERT_EQUAL(LSS_OP_QUERY_LIGHT, reply[16]);
+    TEST_ASSERT_EQUAL(2, reply[18]);
+    memcpy(&value, reply + 24, 4);
+    TEST_ASSERT_EQUAL(first, value);
+    TEST_ASSERT_EQUAL(LSS_OP_TURN_NOW, reply[32]);
+    TEST_ASSERT_EQUAL(1, reply[33]);    // Invalid light id
+    TEST_ASSERT_EQUAL(LSS_OP_REMOVE, reply[40]);
+    TEST_ASSERT_EQUAL(1, reply[41]);    // Unknown event id
+
+    int ids[4];
+    TEST_ASSERT_EQUAL(2, LightScheduler_eventsForLight(77, ids, 4));
+    close(fd);
+    LightSchedulerServer_close();
+}
+
+// Connect a client to the command socket at path
+static int connect_client(const char *path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strcpy(addr.sun_path, path);
+    TEST_ASSERT_EQUAL(0, connect(fd, (struct sockaddr *)&addr, sizeof(addr)));
+    return fd;
+}
+
+// Test that clients pipelining more than the poll budget all get served in
+// the same call, whatever their slot
+void test_command_socket_shares_budget_between_clients(){
+    const char *path = "/tmp/light_scheduler_test.sock";
+    uint8_t batch[64 * LSS_REQUEST_SIZE];
+    uint8_t reply[64 * 8];
+    int fds[5];
+    TEST_ASSERT_EQUAL(0, LightSchedulerServer_open(path));
+    for(int i = 0; i < 5; i++) fds[i] = connect_client(path);
+    LightSchedulerServer_poll(0);      // Accept
+
+    for(int r = 0; r < 64; r++) put_request(batch + r * LSS_REQUEST_SIZE, LSS_OP_QUERY_LIGHT, 0, 1, 0, 0, 0);
+    for(int i = 0; i < 5; i++) TEST_ASSERT_EQUAL(sizeof(batch), write(fds[i], batch, sizeof(batch)));
+    TEST_ASSERT_EQUAL(LSS_POLL_BUDGET, LightSchedulerServer_poll(0));
+    for(int i = 0; i < 5; i++) {
+        TEST_ASSERT_TRUE(recv(fds[i], reply, sizeof(reply), MSG_DONTWAIT) >= 8);
+        close(fds[i]);
+    }
+    LightSchedulerServer_close();
+}
+
+// Test that open replaces the socket of a crashed daemon but never takes the
+// path from a running one, nor deletes a file that is not a socket
+void test_command_socket_open_only_replaces_stale_socket(){
+    const char *path = "/tmp/light_scheduler_test.sock";
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    int other = socket(AF_UNIX, SOCK_STREAM, 0);
+    TEST_ASSERT_EQUAL(0, bind(other, (struct sockaddr *)&addr, sizeof(addr)));
+    TEST_ASSERT_EQUAL(0, listen(other, 1));
+    TEST_ASSERT_EQUAL(-1, LightSchedulerServer_open(path));    // Running daemon
+    TEST_ASSERT_EQUAL(0, access(path, F_OK));
+    close(other);                                               // Crashed: the socket file stays
+    TEST_ASSERT_EQUAL(0, LightSchedulerServer_open(path));
+    LightSchedulerServer_close();
+
+    FILE *file = fopen(path, "w");
+    TEST_ASSERT_NOT_NULL(file);
+    fclose(file);
+    TEST_ASSERT_EQUAL(-1, LightSchedulerServer_open(path));
+    TEST_ASSERT_EQUAL(0, access(path, F_OK));
+    unlink(path);
+}
+
+// Test that a client pipelining requests without reading its responses is
+// parked on POLLOUT once its output is full, instead of making poll spin
+void test_command_socket_waits_for_client_not_reading(){
+    const char *path = "/tmp/light_scheduler_test.sock";
+    uint8_t batch[600 * LSS_REQUEST_SIZE];
+    for(int m = 0; m < 200; m++) LightScheduler_schedule(1, MONDAY, m, TURN_ON);
+    TEST_ASSERT_EQUAL(0, LightSchedulerServer_open(path));
+    int fd = connect_client(path);
+    LightSchedulerServer_poll(0);      // Accept
+    for(int r = 0; r < 600; r++) put_request(batch + r * LSS_REQUEST_SIZE, LSS_OP_QUERY_LIGHT, 0, 1, 0, 0, 0);
+    TEST_ASSERT_EQUAL(sizeof(batch), write(fd, batch, sizeof(batch)));
+    for(int i = 0; i < 100 && LightSchedulerServer_poll(0) > 0; i++) {}     // Until the socket is full
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int i = 0; i < 5; i++) TEST_ASSERT_EQUAL(0, LightSchedulerServer_poll(20));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long elapsedMs = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    TEST_ASSERT_TRUE(elapsedMs >= 80);
+
+    uint8_t reply[4096];
+    while(recv(fd, reply, sizeof(reply), MSG_DONTWAIT) > 0) {}
+    int served = 0;
+    for(int i = 0; i < 5 && served == 0; i++) served = LightSchedulerServer_poll(20);
+    TEST_ASSERT_TRUE(served > 0);       // Served again once the client reads
+    close(fd);
+    LightSchedulerServer_close();
+}
+
+// Test that clients shutting down their side right after a batch still get
+// every response (some requests are still buffered when the server reads the
+// end of the stream) before the server closes the connection
+void test_command_socket_answers_batch_after_half_close(){
+    const char *path = "/tmp/light_scheduler_test.sock";
+    uint8_t batch[64 * LSS_REQUEST_SIZE];
+    uint8_t reply[64 * 8 + 1];
+    int fds[5], got[5] = {0}, closed = 0;
+    TEST_ASSERT_EQUAL(0, LightSchedulerServer_open(path));
+    for(int i = 0; i < 5; i++) fds[i] = connect_client(path);
+    LightSchedulerServer_poll(0);      // Accept
+
+    for(int r = 0; r < 64; r++) put_request(batch + r * LSS_REQUEST_SIZE, LSS_OP_QUERY_LIGHT, 0, 1, 0, 0, 0);
+    for(int i = 0; i < 5; i++) {
+        TEST_ASSERT_EQUAL(sizeof(batch), write(fds[i], batch, sizeof(batch)));
+        TEST_ASSERT_EQUAL(0, shutdown(fds[i], SHUT_WR));
+    }
+    for(int t = 0; t < 50 && closed < 5; t++) {
+        LightSchedulerServer_poll(10);
+        for(int i = 0; i < 5; i++) {
+            if(fds[i] < 0) continue;
+            ssize_t n = recv(fds[i], reply, sizeof(reply), MSG_DONTWAIT);
+            if(n > 0) got[i] += n;
+            if(n == 0) {                // Closed by the server
+                close(fds[i]);
+                fds[i] = -1;
+                closed++;
+            }
+        }
+    }
+    TEST_ASSERT_EQUAL(5, closed);
+    for(int i = 0; i < 5; i++) TEST_ASSERT_EQUAL(64 * 8, got[i]);
+    LightSchedulerServer_close();
+}
+
+// Test that the optimized wakeup, stateAt, query and apply paths agree with
+// the reference scan on randomized schedules with groups, calendars and
+// static tables
+void test_differential_check_finds_no_divergence(){
+    LightCheckReport report;
+    int rc = LightSchedulerCheck_run(1, 200, &report);
+    if(rc != 0) LightSchedulerCheck_print(&report, stdout);
+    TEST_ASSERT_EQUAL(0, rc);
+    TEST_ASSERT_EQUAL(200, report.cases);
+}
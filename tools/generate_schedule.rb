@@ -0,0 +1,134 @@
+# Turns a schedule definition (schedules/*.sched) into a const, pre-sorted and
+# pre-indexed LightScheduleTable that LightScheduler_initStatic runs from.
+#
+# usage: ruby tools/generate_schedule.rb schedules/office.sched generated/LightSchedule_office.c
+#
+# Definition format, one event per line, '#' starts a comment:
+#   <lightId> <MONDAY..SUNDAY|EVERYDAY|WEEKDAY|WEEKEND> <HH:MM> <ON|OFF>
+
+DAYS = {
+  'MONDAY' => 1, 'TUESDAY' => 2, 'WEDNESDAY' => 3, 'THURSDAY' => 4,
+  'FRIDAY' => 5, 'SATURDAY' => 6, 'SUNDAY' => 7,
+  'EVERYDAY' => 10, 'WEEKDAY' => 11, 'WEEKEND' => 12
+}
+# Enumerator names of TimeService.h (THURSDAY is spelled THURDSDAY there)
+DAY_NAMES = DAYS.map { |name, value| [value, name == 'THURSDAY' ? 'THURDSDAY' : name] }.to_h
+MAX_EVENTS = 256
+
+def fail_at(file, line, message)
+  abort "#{file}:#{line}: #{message}"
+end
+
+# Same rule as matches_day() in src/LightScheduler.c
+def matches_day(scheduled, current)
+  return true if scheduled == 10
+  return current.between?(1, 5) if scheduled == 11
+  return current == 6 || current == 7 if scheduled == 12
+  scheduled == current
+end
+
+def parse(file)
+  events = []
+  File.readlines(file).each_with_index do |raw, index|
+    line = raw.sub(/#.*/, '').strip
+    next if line.empty?
+    fields = line.split
+    fail_at(file, index + 1, 'expected: lightId day HH:MM ON|OFF') unless fields.size == 4
+    light, day, time, action = fields
+    fail_at(file, index + 1, "invalid light id #{light}") unless light =~ /\A\d+\z/ && light.to_i <= 255
+    fail_at(file, index + 1, "invalid day #{day}") unless DAYS.key?(day.upcase)
+    fail_at(file, index + 1, "invalid time #{time}") unless time =~ /\A(\d{1,2}):(\d{2})\z/ && $1.to_i < 24 && $2.to_i < 60
+    minute = $1.to_i * 60 + $2.to_i
+    fail_at(file, index + 1, "invalid action #{action}") unless %w[ON OFF].include?(action.upcase)
+    events << { light: light.to_i, day: DAYS[day.upcase], minute: minute, on: action.upcase == 'ON' }
+  end
+  abort "#{file}: more than #{MAX_EVENTS} events" if events.size > MAX_EVENTS
+  # Stable sort by minute: inside a minute the definition order is the firing order
+  events.each_with_index.sort_by { |e, i| [e[:minute], i] }.map(&:first)
+end
+
+def build(events)
+  events.each_with_index { |e, slot| e[:slot] = slot }
+  by_light = events.group_by { |e| e[:light] }
+  by_light.each_value do |list|
+    list.each_cons(2) { |a, b| a[:next] = b[:slot]; b[:prev] = a[:slot] }
+  end
+  head = Array.new(256) { |l| by_light.key?(l) ? by_light[l].first[:slot] : -1 }
+  days = (1..7).map { |d| events.select { |e| matches_day(e[:day], d) }.map { |e| e[:slot] } }
+  transitions = Array.new(256) { [] }
+  days.each_with_index do |slots, row|
+    slots.each do |slot|
+      e = events[slot]
+      transitions[e[:light]] << [row * 24 * 60 + e[:minute], slot, e[:on] ? 'TURN_ON' : 'TURN_OFF']
+    end
+  end
+  { head: head, days: days, transitions: transitions }
+end
+
+def int_rows(values)
+  values.each_slice(16).map { |row| '    ' + row.join(', ') }.join(",\n")
+end
+
+def emit(source, output, events, index)
+  name = File.basename(output, '.c')
+  day_flat = index[:days].flatten
+  starts = index[:transitions].map(&:size).inject([0]) { |acc, n| acc << acc.last + n }
+  transitions = index[:transitions].flatten(1)
+  day_offsets = index[:days].map(&:size).inject([0]) { |acc, n| acc << acc.last + n }
+
+  File.open(output, 'w') do |f|
+    f.puts "/* Generated by tools/generate_schedule.rb from #{source}. Do not edit. */"
+    f.puts '#include "LightScheduler.h"'
+    f.puts
+    f.puts 'static const ScheduledEvent events[] = {'
+    f.puts events.map { |e|
+      "    { .id = #{e[:slot]}, .lightId = #{e[:light]}, .day = #{DAY_NAMES[e[:day]]}, " \
+      ".minute = #{e[:minute]}, .action = #{e[:on] ? 'TURN_ON' : 'TURN_OFF'}, .active = true, " \
+      ".one_minute_befores = true, .nextForLight = #{e[:next] || -1}, .prevForLight = #{e[:prev] || -1} }"
+    }.join(",\n") unless events.empty?
+    f.puts "    { .id = -1 }" if events.empty?
+    f.puts '};'
+    f.puts
+    f.puts 'static const int lightHead[256] = {'
+    f.puts int_rows(index[:head])
+    f.puts '};'
+    f.puts
+    f.puts 'static const int dayIndex[] = {'
+    f.puts day_flat.empty? ? '    -1' : int_rows(day_flat)
+    f.puts '};'
+    f.puts
+    f.puts 'static const ScheduleTransition transitions[] = {'
+    f.puts transitions.empty? ? '    { 0, 0, 0 }' : transitions.map { |t| "    { #{t[0]}, #{t[1]}, #{t[2]} }" }.join(",\n")
+    f.puts '};'
+    f.puts
+    f.puts 'static const int transitionStart[257] = {'
+    f.puts int_rows(starts)
+    f.puts '};'
+    f.puts
+    f.puts "const LightScheduleTable #{name} = {"
+    f.puts '    .events = events,'
+    f.puts "    .eventCount = #{events.size},"
+    f.puts '    .lightHead = lightHead,'
+    f.puts "    .dayIndex = { #{(0..6).map { |d| "dayIndex + #{day_offsets[d]}" }.join(', ')} },"
+    f.puts "    .dayCount = { #{index[:days].map(&:size).join(', ')} },"
+    f.puts '    .transitions = transitions,'
+    f.puts '    .transitionStart = transitionStart'
+    f.puts '};'
+  end
+
+  File.open(output.sub(/\.c\z/, '.h'), 'w') do |f|
+    guard = name.gsub(/([a-z])([A-Z])/, '\1_\2').upcase + '_H'
+    f.puts "/* Generated by tools/generate_schedule.rb from #{source}. Do not edit. */"
+    f.puts "#ifndef #{guard}"
+    f.puts "#define #{guard}"
+    f.puts '#include "LightScheduler.h"'
+    f.puts
+    f.puts "extern const LightScheduleTable #{name};"
+    f.puts
+    f.puts '#endif'
+  end
+end
+
+abort 'usage: generate_schedule.rb <definition.sched> <output.c>' unless ARGV.size == 2
+events = parse(ARGV[0])
+emit(ARGV[0], ARGV[1], events, build(events))